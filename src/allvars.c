@@ -14,20 +14,19 @@ Notes:
 int thistask;
 int ntasks;
 MPI_Datatype mpi_header_type;
-MPI_Datatype mpi_particle_type;
 
 // Files
 char snapfile[256];
 char part_file[100];
 char halo_file[100];
 char subfile[100];
+char ahf_fnames[3][256];
+int ahf_set = 0;
 
 // Cosmology
 float a_dot;
 int nhalos_local;
 int nhalos_tot = 0;
-int nhalos_max;
-int max_subs_global;
 float LITTLE_H;
 float OMEGA_R0;
 float OMEGA_K0;
@@ -55,3 +54,13 @@ IO_HEADER header;
 
 // Halo Data
 HALO_DATA *H;
+int *halo_plist = NULL;
+long int halo_plist_len = 0;
+long int *halo_sublist = NULL;
+long int halo_sublist_len = 0;
+HALO_INDEX halo_index = {0, NULL, NULL};
+char *halo_cache_map = NULL;
+size_t halo_cache_length = 0;
+HALO_SET *halo_sets = NULL;
+int halo_set_first = 0;
+int halo_set_count = 0;
@@ -13,20 +13,19 @@ Notes:
     extern int thistask;
     extern int ntasks;
     extern MPI_Datatype mpi_header_type;
-    extern MPI_Datatype mpi_particle_type;
 
    // Files
    extern char snapfile[256];  // Holds file name for snapshot
    extern char part_file[100]; // Holds amiga particles data
    extern char halo_file[100]; // Holds amiga halo data
    extern char subfile[100];   // Holds amiga substructure data
+   extern char ahf_fnames[3][256]; // The AHF particles, substructure and halos files being read
+   extern int ahf_set;             // Which AHF file set those are
 
    // Cosmology
    extern float a_dot;
    extern int nhalos_local;    // Number of halos in a give file set
    extern int nhalos_tot;      // Total number of halos across all file sets
-   extern int nhalos_max;      // Max number of halos held by a single processor
-   extern int max_subs_global; // The max number of subhalos held by a single host
    extern float LITTLE_H;
    extern float OMEGA_R0;
    extern float OMEGA_K0;
@@ -57,6 +56,73 @@ Notes:
                               // the number of AHF file sets, which is the number of
                               // cores AHF was run with.
 
+   // HDF5 snapshots are always read in parallel (see hdf5_io.c)
+   #ifdef HDF5_SNAPSHOT
+      #define PARALLEL_READ
+   #endif
+
+   // Streaming does its own reading
+   #if defined(STREAMING) && (defined(PARALLEL_READ) || defined(MMAP_SNAPSHOT))
+      #error "STREAMING can't be used with PARALLEL_READ, MMAP_SNAPSHOT or HDF5_SNAPSHOT"
+   #endif
+
+   // Rows per chunk of the datasets in the HDF5 output
+   #ifndef HDF5_CHUNK
+      #define HDF5_CHUNK 65536
+   #endif
+
+   // Max number of particles each task holds at once when streaming
+   #ifndef STREAM_CHUNK
+      #define STREAM_CHUNK 1048576
+   #endif
+
+   // Max number of particles each task reads at once when copying pos, vel and
+   // hsml from the snapshot to the output
+   #ifndef PASSTHROUGH_CHUNK
+      #define PASSTHROUGH_CHUNK 1048576
+   #endif
+
+   // Size of the AHF_READER buffer, and the longest number it has to be able
+   // to parse without refilling
+   #define AHF_BUFSIZE 4194304
+   #define AHF_TOKEN_MAX 64
+
+   // The second column of an AHF_particles line is the particle type, which
+   // is never more than this, or, on a halo's first line, the halo id, which
+   // (almost) always is. See read_halo_particles_split
+   #define AHF_MAX_PTYPE 64
+
+   // Max number of elements sent at once by gather_on_root
+   #define GATHER_CHUNK 16777216
+
+   // Tags for the sub halo headers and plists sent back in remove_duplicates.
+   // The replies say which halo they're for, so they don't need a tag each
+   #define REMOVE_DUPLICATES_TAG 1
+   #define REMOVE_DUPLICATES_PLIST_TAG 2
+
+   // Max number of particle ids root takes at once when flagging multiple
+   // file sets (see flag_halo_parts_mult_file_sets)
+   #define FLAG_BATCH 16777216
+
+   // With HIERARCHY_FLAGGING a halo's depth goes in front of its order in the
+   // key sent with its particles (see get_flag_key), so it has to be more
+   // than any order
+   #define FLAG_DEPTH_STRIDE (1L << 40)
+
+   // Marks a file as a halo cache (see halo_cache.c). The version has to be
+   // bumped whenever the layout of the cache changes
+   #define HALO_CACHE_MAGIC 0x4f4c4148
+   #define HALO_CACHE_VERSION 3
+
+   // Number of buckets per radix sort pass (16 bit digits)
+   #define RADIX_BUCKETS 65536
+
+   // Plists up to this long get an insertion sort, and longer ones a radix
+   // sort with this many bits per pass (see sort_plist)
+   #define PLIST_INSERTION_MAX 64
+   #define PLIST_RADIX_BITS 8
+   #define PLIST_RADIX_BUCKETS (1 << PLIST_RADIX_BITS)
+
    // Fields for block checking
    enum fields
    {
@@ -69,6 +135,9 @@ Notes:
       HSML
    };   
 
+   // Number of entries in enum fields
+   #define NFIELDS 7
+
    // Snapshot header
    typedef struct IO_HEADER
    {
@@ -88,35 +157,158 @@ Notes:
       char fill[96];
    } IO_HEADER;
 
-   // Particle data
+   // Particle data. The gas is stored as one array per field rather than one
+   // struct per particle, so that each loop only pulls in the fields it uses.
+   // Only what tspec reads or changes is kept in memory. pos, vel and hsml go
+   // straight from the snapshot to the output when it's written (see
+   // passthrough.c), and the masses and types aren't kept at all. A field is
+   // only allocated while it's needed and is NULL otherwise: in_halo and m_vir
+   // are added by flag_halo_parts and temp by get_temperatures. in_halo is a
+   // bitset (see IN_HALO). See alloc_particles.
    typedef struct PARTICLE_DATA
    {
-      float pos[3];
-      float vel[3];
-      float mass;
-      float density;
-      float temp;
-      float hsml;
-      float m_vir;
-      int type;
-      int id;
-      int in_halo;
+      int n;              // Number of particles
+      int *id;
+      float *density;
+      float *temp;
+      float *m_vir;
+      unsigned char *in_halo;
    } PARTICLE_DATA;
 
-   // Halos struct
+   // Number of per-particle fields in PARTICLE_DATA, not counting the in_halo
+   // bitset
+   #define NPFIELDS 4
+
+   // Describes one field of PARTICLE_DATA so that copying, resizing and sending
+   // particles can loop over the fields (see get_particle_fields)
+   typedef struct PARTICLE_FIELD
+   {
+      void **data;        // Address of the field's pointer in PARTICLE_DATA
+      size_t size;        // Bytes per particle
+      int ncomp;          // Values per particle
+      MPI_Datatype type;  // MPI type of each value
+   } PARTICLE_FIELD;
+
+   // Reading and setting particle i's bit in an in_halo bitset
+   #define IN_HALO(bits, i) (((bits)[(i) >> 3] >> ((i) & 7)) & 1)
+   #define SET_IN_HALO(bits, i) ((bits)[(i) >> 3] |= (unsigned char)(1 << ((i) & 7)))
+
+   // Number of bytes in a bitset of n particles
+   #define BITSET_BYTES(n) (((n) + 7) / 8)
+
+   // Where the blocks that tspec uses are in a snapshot segment (see
+   // scan_blocks). offset is that of the block's leading padding, or -1 if the
+   // block isn't in the segment, and size is the block's size in bytes
+   typedef struct BLOCK_DIR
+   {
+      int format;              // SnapFormat of the segment, 1 or 2
+      IO_HEADER header;        // This segment's header
+      long offset[NFIELDS];
+      int size[NFIELDS];
+   } BLOCK_DIR;
+
+   // Typed views into a memory-mapped snapshot segment. The pointers point
+   // straight into the mapping, so nothing is copied until the particles are
+   // actually used.
+   typedef struct SNAP_SEGMENT
+   {
+      char *map;         // Start of the mapping
+      size_t length;     // Length of the mapping in bytes
+      IO_HEADER header;  // This segment's header
+      int *id;           // Gas part of the IDS block, past the type 0 ids
+      float *density;
+   } SNAP_SEGMENT;
+
+   // Halos struct. The particle ids of every halo are kept one after the other
+   // in halo_plist, and the sub halo ids in halo_sublist, so a halo only holds
+   // where its lists start. Use PLIST and SUBLIST to get at them
    typedef struct HALO_DATA
    {
       int npart;         // Number of particles in halo
       int new_id;        // Ressigned halo id for use as an mpi tag
       long int hid;      // halo id
-      int *plist;        // Holds list of particle ids that are in halo
+      long int pstart;   // Where the halo's particle ids start in halo_plist
       int nsub;          // Number of sub halos the halo has
-      long int *sublist; // List of sub halo ids
+      int depth;         // Number of hosts above the halo (see get_halo_depths)
+      long int sstart;   // Where the halo's sub halo ids start in halo_sublist
       float m_vir;       // halo's virial mass
       long int host_id;  // ID of halo's host. 0 if there is no host 
+      long int order;    // Where the halo comes when flagging (see set_halo_order)
    } HALO_DATA;
 
+   // Halo i's list of particle ids and list of sub halo ids
+   #define PLIST(i) (halo_plist + H[i].pstart)
+   #define SUBLIST(i) (halo_sublist + H[i].sstart)
+
+   // Open addressing hash table from halo id to index in an array of halos
+   // (see find_halo). size is a power of two and empty slots have index -1
+   typedef struct HALO_INDEX
+   {
+      long int size;
+      long int *hid;
+      int *index;
+   } HALO_INDEX;
+
+   // One AHF file set and the tasks that read it (see assign_halo_sets). A set
+   // is either read whole by one task, which might read other sets too, or
+   // split between ntasks tasks that read nothing else
+   typedef struct HALO_SET
+   {
+      char fnames[3][256]; // Particles, substructure and halos files
+      long int size;       // Size of the particles file
+      int first_task;
+      int ntasks;
+   } HALO_SET;
+
+   // A halo particle on its way to being flagged. hind is the halo's key (see
+   // get_flag_key) and order is where it arrived, which together decide which
+   // halo wins when a particle is in more than one plist
+   typedef struct HALO_PAIR
+   {
+      int pid;
+      long int hind;
+      int order;
+      float m_vir;
+   } HALO_PAIR;
+
+   // Buffered reader for the AHF ascii files (see read_ahf_long). The file is
+   // read AHF_BUFSIZE bytes at a time and the numbers are parsed straight out
+   // of buf, which is always null-terminated at len
+   typedef struct AHF_READER
+   {
+      FILE *fd;
+      char *buf;
+      size_t len;        // Number of bytes in buf
+      size_t pos;        // Next unread byte
+      int eof;           // Set once everything in the file is in buf
+      long offset;       // Where buf starts in the file
+   } AHF_READER;
+
+   // Start of a halo cache file. The AHF files it was made from are, in
+   // order, the particles, substructure and halos files. The header is
+   // followed by the arrays listed in write_halo_cache
+   typedef struct HALO_CACHE_HEADER
+   {
+      int magic;
+      int version;
+      long src_size[3];  // Sizes of the AHF files in bytes
+      long src_mtime[3]; // Modification times of the AHF files
+      int nhalos;
+      long npart_tot;    // Length of halo_plist
+      long nsub_tot;     // Length of halo_sublist
+   } HALO_CACHE_HEADER;
+
    // Global structures
    extern IO_HEADER header;   // Master header for the snapshot
    extern HALO_DATA *H;       // Structure for holding all the halo info
+   extern int *halo_plist;          // Every halo's particle ids (see HALO_DATA)
+   extern long int halo_plist_len;
+   extern long int *halo_sublist;   // Every halo's sub halo ids
+   extern long int halo_sublist_len;
+   extern HALO_INDEX halo_index;    // Finds a halo in H by its id
+   extern char *halo_cache_map;    // The mapped halo cache, if H came from one
+   extern size_t halo_cache_length;
+   extern HALO_SET *halo_sets;     // Every AHF file set
+   extern int halo_set_first;      // First of the sets this task reads
+   extern int halo_set_count;      // Number of sets this task reads
 #endif
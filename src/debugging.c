@@ -6,33 +6,476 @@ Notes:
 ************************************************/
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <mpi.h>
 #include "allvars.h"
 #include "proto.h"
 
 
 
-void write_flagged_particles(PARTICLE_DATA *P, int ngas)
+void write_flagged_particles(PARTICLE_DATA *P)
 {
     // Write all of the particles flagged as being in halos to a file, since gdb
     // is very slow at this. Also write all of the halo particles to a file (sans-duplicates)
     // because I believe remove_duplicates works
+    // Unless root did the flagging (ROOT_FLAGGING) every task calls this with its own
+    // slab and they take turns appending to the file, in order, so the file is the
+    // same either way.
     FILE *fd;
     int i;
+    int task;
+    int ntasks_writing = 1;
 
-    if(!(fd = fopen("flaggedparts_code.txt", "w")))
+    #if !defined(ROOT_FLAGGING) || defined(PARALLEL_READ)
+       ntasks_writing = ntasks;
+    #endif
+
+    for(task = 0; task < ntasks_writing; task++)
+    {
+      if(task == thistask)
+      {
+         if(!(fd = fopen("flaggedparts_code.txt", (task == 0) ? "w" : "a")))
+         {
+           printf("Error, cold not open file for writing flagged particles!\n");
+           exit(EXIT_FAILURE);
+         }
+
+         for(i = 0; i < P->n; i++)
+         {
+           if(IN_HALO(P->in_halo, i))
+           {
+              fprintf(fd, "%d\n", P->id[i]);
+           }
+         }
+
+         fclose(fd);
+      }
+
+      #if !defined(ROOT_FLAGGING) || defined(PARALLEL_READ)
+         MPI_Barrier(MPI_COMM_WORLD);
+      #endif
+    }
+}
+
+
+
+void write_halo_table(int *pids, int n)
+{
+    // Same as write_flagged_particles, but for STREAMING, where there's no P. Every
+    // task's halo table holds the flagged particles it owns, in order, so the tasks
+    // take turns writing them out.
+    FILE *fd;
+    int i;
+    int task;
+
+    for(task = 0; task < ntasks; task++)
+    {
+      if(task == thistask)
+      {
+         if(!(fd = fopen("flaggedparts_code.txt", (task == 0) ? "w" : "a")))
+         {
+           printf("Error, cold not open file for writing flagged particles!\n");
+           exit(EXIT_FAILURE);
+         }
+
+         for(i = 0; i < n; i++)
+         {
+            fprintf(fd, "%d\n", pids[i]);
+         }
+
+         fclose(fd);
+      }
+
+      MPI_Barrier(MPI_COMM_WORLD);
+    }
+}
+
+
+void benchmark_ahf_parser(void)
+{
+    // Times reading this task's AHF_particles file with fscanf, the way
+    // read_halo_particles used to, against the AHF_READER it uses now. Both
+    // sum everything they read so that we know they agree.
+    FILE *fd;
+    AHF_READER r;
+    char *fname;
+    int i;
+    int j;
+    int pass;
+    int nhalos;
+    int npart;
+    int pid;
+    int type;
+    long int hid;
+    long nlines[2] = {0, 0};
+    long sum[2] = {0, 0};
+    double t[2];
+
+    fname = get_halo_fname("p");
+
+    for(pass = 0; pass < 2; pass++)
+    {
+      if(!(fd = fopen(fname, "r")))
+      {
+         printf("Error, could not open particles file for benchmark!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      t[pass] = MPI_Wtime();
+
+      if(pass == 0)
+      {
+         fscanf(fd, " %d\n", &nhalos);
+         nlines[pass]++;
+
+         for(i = 0; i < nhalos; i++)
+         {
+            fscanf(fd, "%d %ld\n", &npart, &hid);
+            sum[pass] += npart + hid;
+            nlines[pass]++;
+
+            for(j = 0; j < npart; j++)
+            {
+               fscanf(fd, "%d %d\n", &pid, &type);
+               sum[pass] += pid + type;
+               nlines[pass]++;
+            }
+         }
+
+         fclose(fd);
+      }
+
+      else
+      {
+         open_ahf_reader(&r, fd);
+         nhalos = read_ahf_long(&r);
+         nlines[pass]++;
+
+         for(i = 0; i < nhalos; i++)
+         {
+            npart = read_ahf_long(&r);
+            hid = read_ahf_long(&r);
+            sum[pass] += npart + hid;
+            nlines[pass]++;
+
+            for(j = 0; j < npart; j++)
+            {
+               pid = read_ahf_long(&r);
+               type = read_ahf_long(&r);
+               sum[pass] += pid + type;
+               nlines[pass]++;
+            }
+         }
+
+         close_ahf_reader(&r);
+      }
+
+      t[pass] = MPI_Wtime() - t[pass];
+    }
+
+    if(sum[0] != sum[1])
+    {
+      printf("Error, task %d's AHF parser doesn't agree with fscanf!\n", thistask);
+      exit(EXIT_FAILURE);
+    }
+
+    printf("Task %d parsed %ld lines: fscanf %e lines/sec, AHF parser %e lines/sec\n",
+           thistask, nlines[1], nlines[0] / t[0], nlines[1] / t[1]);
+    fflush(stdout);
+
+    free(fname);
+}
+
+
+
+void benchmark_halo_index(int nhalos)
+{
+    // Times finding every one of nhalos made up halos with a HALO_INDEX
+    // against searching for them from the start of the array, which is what
+    // read_halo_substruct and remove_duplicates used to do. The search is
+    // only timed for a few of the halos, since doing all of them is
+    // quadratic, and scaled up.
+    HALO_DATA *halos;
+    HALO_INDEX idx = {0, NULL, NULL};
+    int i;
+    int j;
+    int nsearch = 1000;
+    long check[2] = {0, 0};
+    double t_build;
+    double t_find;
+    double t_search;
+
+    if(!(halos = calloc(nhalos, sizeof(HALO_DATA))))
+    {
+      printf("Error, could not allocate memory for benchmark halos!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    // AHF style ids: big, unique and mostly increasing
+    srand(1);
+
+    for(i = 0; i < nhalos; i++)
+    {
+      halos[i].hid = 1000000000000L + 1000L * i + rand() % 1000;
+    }
+
+    t_build = MPI_Wtime();
+    build_halo_index(&idx, halos, nhalos);
+    t_build = MPI_Wtime() - t_build;
+
+    t_find = MPI_Wtime();
+
+    for(i = 0; i < nhalos; i++)
+    {
+      check[0] += find_halo(&idx, halos[i].hid);
+    }
+
+    t_find = MPI_Wtime() - t_find;
+
+    if(nsearch > nhalos)
+    {
+      nsearch = nhalos;
+    }
+
+    t_search = MPI_Wtime();
+
+    for(i = 0; i < nsearch; i++)
+    {
+      for(j = 0; halos[j].hid != halos[(long)i * nhalos / nsearch].hid; j++)
+      {
+         continue;
+      }
+
+      check[1] += j;
+    }
+
+    t_search = MPI_Wtime() - t_search;
+
+    if(check[0] != (long)nhalos * (nhalos - 1) / 2)
+    {
+      printf("Error, the halo index didn't find every halo!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    printf("Halo index for %d halos: built in %e secs, %e lookups/sec. Searching: %e lookups/sec "
+           "(%e secs for all of them) [%ld]\n", nhalos, t_build, nhalos / t_find,
+           nsearch / t_search, t_search * nhalos / nsearch, check[1]);
+    fflush(stdout);
+
+    free_halo_index(&idx);
+    free(halos);
+}
+
+
+
+void benchmark_plist_sort(void)
+{
+    // Times sorting every plist in this task's AHF_particles file with qsort,
+    // the way read_halo_particles used to, against sort_plist, so that the
+    // mix of halo sizes is a real one. Both are timed on the plists as they
+    // are in the file, which AHF might have sorted already, and again with
+    // each plist shuffled.
+    FILE *fd;
+    AHF_READER r;
+    char *fname;
+    int i;
+    int pass;
+    int nhalos;
+    int nsorted = 0;
+    int largest = 0;
+    int tmp;
+    int *npart;
+    int *pids = NULL;
+    int *work;
+    int *ref;
+    long int j;
+    long int k;
+    long int start;
+    long int total = 0;
+    long int max_pids = 0;
+    double t[2][2];
+
+    fname = get_halo_fname("p");
+
+    if(!(fd = fopen(fname, "r")))
+    {
+      printf("Error, could not open particles file for benchmark!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    open_ahf_reader(&r, fd);
+    nhalos = read_ahf_long(&r);
+
+    if(!(npart = calloc(nhalos + 1, sizeof(int))))
+    {
+      printf("Error, could not allocate memory for benchmark plists!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    for(i = 0; i < nhalos; i++)
+    {
+      npart[i] = read_ahf_long(&r);
+      read_ahf_long(&r);
+
+      pids = grow_halo_list(pids, &max_pids, total + npart[i] + 1, sizeof(int));
+
+      for(j = 0; j < npart[i]; j++)
+      {
+         pids[total + j] = read_ahf_long(&r);
+         read_ahf_long(&r);
+      }
+
+      for(j = 1; (j < npart[i]) && (pids[total + j - 1] <= pids[total + j]); j++)
+      {
+         continue;
+      }
+
+      if(j >= npart[i])
+      {
+         nsorted++;
+      }
+
+      if(npart[i] > largest)
+      {
+         largest = npart[i];
+      }
+
+      total += npart[i];
+    }
+
+    close_ahf_reader(&r);
+
+    if(!(work = malloc((total + 1) * sizeof(int))) || !(ref = malloc((total + 1) * sizeof(int))))
+    {
+      printf("Error, could not allocate memory for benchmark plists!\n");
+      exit(EXIT_FAILURE);
+    }
+
+    srand(1);
+
+    for(pass = 0; pass < 2; pass++)
+    {
+      // Shuffle each plist for the second pass
+      if(pass == 1)
+      {
+         for(i = 0, start = 0; i < nhalos; start += npart[i], i++)
+         {
+            for(j = npart[i] - 1; j > 0; j--)
+            {
+               k = rand() % (j + 1);
+               tmp = pids[start + j];
+               pids[start + j] = pids[start + k];
+               pids[start + k] = tmp;
+            }
+         }
+      }
+
+      memcpy(ref, pids, total * sizeof(int));
+      memcpy(work, pids, total * sizeof(int));
+
+      t[pass][0] = MPI_Wtime();
+
+      for(i = 0, start = 0; i < nhalos; start += npart[i], i++)
+      {
+         qsort(ref + start, npart[i], sizeof(int), cmpfunc);
+      }
+
+      t[pass][0] = MPI_Wtime() - t[pass][0];
+      t[pass][1] = MPI_Wtime();
+
+      for(i = 0, start = 0; i < nhalos; start += npart[i], i++)
+      {
+         sort_plist(work + start, npart[i]);
+      }
+
+      t[pass][1] = MPI_Wtime() - t[pass][1];
+
+      if(memcmp(ref, work, total * sizeof(int)) != 0)
+      {
+         printf("Error, task %d's sort_plist doesn't agree with qsort!\n", thistask);
+         exit(EXIT_FAILURE);
+      }
+    }
+
+    printf("Task %d sorted %d plists (%ld pids, largest %d, %d already sorted): as read qsort %e "
+           "secs, sort_plist %e secs; shuffled qsort %e secs, sort_plist %e secs\n", thistask,
+           nhalos, total, largest, nsorted, t[0][0], t[0][1], t[1][0], t[1][1]);
+    fflush(stdout);
+
+    free(npart);
+    free(pids);
+    free(work);
+    free(ref);
+    free(fname);
+}
+
+
+
+void benchmark_remove_duplicates(void)
+{
+    // Times remove_duplicates_single_set over every halo in H against
+    // remove_duplicates_single_set_brute, and checks that they remove the same
+    // particles. Only root has the halos when there's one file set. halo_plist
+    // is put back the way it was afterwards.
+    int i;
+    long int j;
+    long int nremoved = 0;
+    int *orig;
+    int *merged;
+    double t_merge;
+    double t_brute;
+
+    if(!(orig = malloc((halo_plist_len + 1) * sizeof(int))) ||
+       !(merged = malloc((halo_plist_len + 1) * sizeof(int))))
     {
-      printf("Error, cold not open file for writing flagged particles!\n");
+      printf("Error, could not allocate memory for benchmark plists!\n");
       exit(EXIT_FAILURE);
     }
 
-    for(i = 0; i < ngas; i++)
+    memcpy(orig, halo_plist, halo_plist_len * sizeof(int));
+
+    t_merge = MPI_Wtime();
+
+    for(i = 0; i < nhalos_local; i++)
+    {
+      remove_duplicates_single_set(i);
+    }
+
+    t_merge = MPI_Wtime() - t_merge;
+
+    memcpy(merged, halo_plist, halo_plist_len * sizeof(int));
+    memcpy(halo_plist, orig, halo_plist_len * sizeof(int));
+
+    t_brute = MPI_Wtime();
+
+    for(i = 0; i < nhalos_local; i++)
+    {
+      remove_duplicates_single_set_brute(i);
+    }
+
+    t_brute = MPI_Wtime() - t_brute;
+
+    for(j = 0; j < halo_plist_len; j++)
     {
-      if(P[i].in_halo == 1)
+      if(merged[j] != halo_plist[j])
       {
-         fprintf(fd, "%d\n", P[i].id);
+         printf("Error, remove_duplicates_single_set doesn't agree with the brute force "
+                "version at plist entry %ld (%d vs %d)!\n", j, merged[j], halo_plist[j]);
+         exit(EXIT_FAILURE);
+      }
+
+      if(merged[j] == -1)
+      {
+         nremoved++;
       }
     }
 
-    fclose(fd);
+    printf("Removed %ld duplicates from %d halos: merge %e secs, brute force %e secs\n",
+           nremoved, nhalos_local, t_merge, t_brute);
+    fflush(stdout);
+
+    memcpy(halo_plist, orig, halo_plist_len * sizeof(int));
+
+    free(orig);
+    free(merged);
 }
@@ -3,7 +3,7 @@ Title: flag.c
 Purpose: Contains functions related to flagging 
          halo particles.
 Notes:   * Particle ids in gadget start at 1, but my array is
-           indexed from 0, hence the index = H[counter].plist[i] - 1
+           indexed from 0, hence the index = PLIST(counter)[i] - 1
 ************************************************/
 #include <stdlib.h>
 #include <stdio.h>
@@ -31,106 +31,428 @@ void flag_halo_parts(PARTICLE_DATA *P)
    // in the two cases, and there's more MPI overhead in the former case, which is why
    // I've split them into two different functions. The general idea is the same in both,
    // it's just easier to read and maintain if they're separate.
+   // That's still how it's done with ROOT_FLAGGING. Otherwise P has already been
+   // split up by id (see split_particles), or read that way with PARALLEL_READ, and
+   // the tasks flag the particles they own instead, so root doesn't do it all.
+   // tspec doesn't have to be run with as many tasks as there are file sets any
+   // more (see halo_sets.c), but the halos are still flagged in the order they'd
+   // be in if it was.
+   // With HIERARCHY_FLAGGING nothing is taken out of the plists. Instead each
+   // particle gets the m_vir of the deepest halo it's in (see get_halo_depths),
+   // and of the one flagged last out of those at the same depth, which is what
+   // removing the duplicates is for.
+
+   // Only the tasks that hold particles have anywhere to put the flags
+   if(P != NULL)
+   {
+      P->in_halo = alloc_field(BITSET_BYTES(P->n), 1);
+      P->m_vir = alloc_field(P->n, sizeof(float));
+   }
 
-   // Case of multiple AHF file sets
-   if(n_halo_tasks != 1)
+   #if defined(ROOT_FLAGGING) && !defined(PARALLEL_READ)
+      // Case of multiple AHF file sets
+      if(n_halo_tasks != 1)
+      {
+         flag_halo_parts_mult_file_sets(P);
+      }
+
+      // Case of one AHF file set
+      else
+      {
+         flag_halo_parts_single_file_set(P);
+      }
+   #else
+      flag_halo_parts_distributed(P);
+   #endif
+}
+
+
+
+/***********************
+flag_halo_parts_distributed
+***********************/
+void flag_halo_parts_distributed(PARTICLE_DATA *P)
+{
+   // Flags halo particles when P is spread over the tasks by id (see get_slab).
+   // Every task gets the halo particles it owns, along with their halos' m_vir and
+   // key, from route_halo_pids and flags them in its own memory.
+
+   int i;
+   int nrecv;
+   int first_id;
+   int n_slab;
+   int index;
+   int *pids;
+   long int *hind;
+   long int *last_hind;
+   float *mvir;
+
+   nrecv = route_halo_pids(&pids, &hind, &mvir);
+
+   // last_hind holds the place in the flagging order of the halo that flagged each
+   // particle so far
+   get_slab(thistask, header.npartTotal[1], &first_id, &n_slab);
+
+   if(!(last_hind = malloc((n_slab + 1) * sizeof(long int))))
+   {
+      printf("Error, could not allocate memory for last_hind!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < n_slab; i++)
    {
-      flag_halo_parts_mult_file_sets(P);
+      last_hind[i] = -1;
    }
 
-   // Case of one AHF file set
-   else
+   for(i = 0; i < nrecv; i++)
    {
-      flag_halo_parts_single_file_set(P);
+      index = pids[i] - first_id;
+
+      SET_IN_HALO(P->in_halo, index);
+
+      if(hind[i] >= last_hind[index])
+      {
+         P->m_vir[index] = mvir[i];
+         last_hind[index] = hind[i];
+      }
    }
+
+   free(last_hind);
+   free(pids);
+   free(hind);
+   free(mvir);
 }
 
 
 
 /***********************
-flag_halo_parts_mult_file_sets
+     get_halo_table
 ***********************/
-void flag_halo_parts_mult_file_sets(PARTICLE_DATA *P)
+int get_halo_table(int **table_pids, float **table_mvir)
 {
-   // Flags which particles belong to halos and assigns
-   // the appropriate m_vir. In parallel this involves sending
-   // the plists to root and having root do the flagging since
-   // there isn't enough memory to give each processor it's own
-   // copy of P.
+   // Used instead of flagging when the snapshot is streamed (see stream.c). Every
+   // task gets the halo particles it owns from route_halo_pids and boils them down
+   // to a table of unique pids, in ascending order, with the m_vir that flagging
+   // would have given them. Returns the number of entries.
 
    int i;
-   int j;
-   int k;
-   int l;
-   int max_subs_local;
-   int totcounts;
-   int *npart_per_plist;
-   int *recvcnts;
-   int *displs;
-   int *plist;
-   int *plist_displs;
-   float *mass_list;
+   int n;
+   int nrecv;
+   int *pids;
+   long int *hind;
+   float *mvir;
+   HALO_PAIR *pairs;
 
-   // Allocate memory for gatherv arrays on root (recvbuf, recvcnts, and displs, etc)
-   if(thistask == 0)
+   nrecv = route_halo_pids(&pids, &hind, &mvir);
+
+   if(!(pairs = malloc((nrecv + 1) * sizeof(HALO_PAIR))))
+   {
+      printf("Error, could not allocate memory for halo table pairs!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < nrecv; i++)
+   {
+      pairs[i].pid = pids[i];
+      pairs[i].hind = hind[i];
+      pairs[i].order = i;
+      pairs[i].m_vir = mvir[i];
+   }
+
+   free(pids);
+   free(hind);
+   free(mvir);
+
+   // Sort by pid, then by halo index, then by arrival, so the last entry for each
+   // pid is the one that wins
+   qsort(pairs, nrecv, sizeof(HALO_PAIR), halo_pair_cmp);
+
+   if(!(*table_pids = malloc((nrecv + 1) * sizeof(int))) ||
+      !(*table_mvir = malloc((nrecv + 1) * sizeof(float))))
+   {
+      printf("Error, could not allocate memory for halo table!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0, n = 0; i < nrecv; i++)
    {
-      if(!(npart_per_plist = calloc(ntasks, sizeof(int))))
+      if((i == nrecv - 1) || (pairs[i + 1].pid != pairs[i].pid))
       {
-         printf("Error, could not allocate memory for recvbuf!\n");
-         exit(EXIT_FAILURE);
+         (*table_pids)[n] = pairs[i].pid;
+         (*table_mvir)[n] = pairs[i].m_vir;
+         n++;
       }
+   }
+
+   free(pairs);
+
+   return n;
+}
+
+
+
+/***********************
+     halo_pair_cmp
+***********************/
+int halo_pair_cmp(const void *p1, const void *p2)
+{
+   // Used with qsort in get_halo_table. Orders by pid, then halo index, then
+   // arrival
+
+   const HALO_PAIR *elem1 = p1;
+   const HALO_PAIR *elem2 = p2;
+
+   if(elem1->pid != elem2->pid)
+   {
+      return (elem1->pid < elem2->pid) ? -1 : 1;
+   }
+
+   if(elem1->hind != elem2->hind)
+   {
+      return (elem1->hind < elem2->hind) ? -1 : 1;
+   }
+
+   return (elem1->order < elem2->order) ? -1 : (elem1->order > elem2->order);
+}
+
+
+
+/***********************
+    route_halo_pids
+***********************/
+int route_halo_pids(int **pid_rbuf, long int **hind_rbuf, float **mvir_rbuf)
+{
+   // Removes duplicates the same way as flag_halo_parts_mult_file_sets and
+   // flag_halo_parts_single_file_set, and then sends every (pid, m_vir) pair to the
+   // task that owns the particle (see get_slab) with one MPI_Alltoallv. The halo's
+   // key (see get_flag_key) goes along with each pair so that, like when root does
+   // the flagging halo by halo, a particle in more than one plist can end up with
+   // the m_vir from the halo that comes last. The pairs
+   // sent here are returned in the three buffers, ordered by sending task, and the
+   // number of them is returned.
 
-      if(!(recvcnts = calloc(ntasks, sizeof(int))))
+   int i;
+   int j;
+   int ngas;
+   int dest;
+   int nsend;
+   int nrecv;
+   int first_id;
+   int n_slab;
+   int *sendcnts;
+   int *recvcnts;
+   int *sdispls;
+   int *rdispls;
+   int *offset;
+   int *pid_sbuf;
+   long int *hind_sbuf;
+   float *mvir_sbuf;
+
+   ngas = header.npartTotal[1];
+
+   #ifdef HIERARCHY_FLAGGING
+      get_halo_depths();
+   #else
+      // Remove duplicates. With one file set only root has the halos
+      if(n_halo_tasks != 1)
       {
-         printf("Error, could not allocate memory for recvcnts!\n");
-         exit(EXIT_FAILURE);
+         remove_duplicates_local();
+         remove_duplicates();
       }
 
-      if(!(displs = calloc(ntasks, sizeof(int))))
+      else if(thistask == 0)
       {
-         printf("Error, could not allocate memory for displs!\n");
-         exit(EXIT_FAILURE);
+         for(i = 0; i < nhalos_local; i++)
+         {
+            remove_duplicates_single_set(i);
+         }
       }
+   #endif
+
+   if(!(sendcnts = calloc(ntasks, sizeof(int))) || !(recvcnts = calloc(ntasks, sizeof(int))) ||
+      !(sdispls = calloc(ntasks, sizeof(int))) || !(rdispls = calloc(ntasks, sizeof(int))) ||
+      !(offset = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for flagging counts!\n");
+      exit(EXIT_FAILURE);
+   }
 
-       if(!(plist_displs = calloc(ntasks, sizeof(int))))
+   // Count how many pairs go to each task. Removed duplicates are -1. nhalos_local is 0
+   // on every task but root when there's one file set.
+   for(i = 0; i < nhalos_local; i++)
+   {
+      for(j = 0; j < H[i].npart; j++)
       {
-         printf("Error, could not allocate memory for plist_displs!\n");
-         exit(EXIT_FAILURE);
+         if(PLIST(i)[j] != -1)
+         {
+            sendcnts[pid_owner(PLIST(i)[j], ngas)]++;
+         }
       }
+   }
+
+   for(i = 1; i < ntasks; i++)
+   {
+      sdispls[i] = sdispls[i - 1] + sendcnts[i - 1];
+   }
+
+   nsend = sdispls[ntasks - 1] + sendcnts[ntasks - 1];
+
+   memcpy(offset, sdispls, ntasks * sizeof(int));
+
+   if(!(pid_sbuf = malloc((nsend + 1) * sizeof(int))) ||
+      !(hind_sbuf = malloc((nsend + 1) * sizeof(long int))) ||
+      !(mvir_sbuf = malloc((nsend + 1) * sizeof(float))))
+   {
+      printf("Error, could not allocate memory for flagging send buffers!\n");
+      exit(EXIT_FAILURE);
+   }
 
-      if(!(mass_list = calloc(ntasks, sizeof(float))))
+   for(i = 0; i < nhalos_local; i++)
+   {
+      for(j = 0; j < H[i].npart; j++)
       {
-        printf("Error, could not allocate memory for mass list!\n");
-        exit(EXIT_FAILURE);
+         if(PLIST(i)[j] != -1)
+         {
+            dest = pid_owner(PLIST(i)[j], ngas);
+            pid_sbuf[offset[dest]] = PLIST(i)[j];
+            hind_sbuf[offset[dest]] = get_flag_key(i);
+            mvir_sbuf[offset[dest]] = H[i].m_vir;
+            offset[dest]++;
+         }
       }
+   }
+
+   MPI_Alltoall(sendcnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
 
-      // Only sending one value at first (npart). Displs refers to the spacing between
-      // elements in index space, so here it's just i, since every processor is only
-      // sending one value.
-      for(i = 0; i < ntasks; i++)
+   for(i = 1; i < ntasks; i++)
+   {
+      rdispls[i] = rdispls[i - 1] + recvcnts[i - 1];
+   }
+
+   nrecv = rdispls[ntasks - 1] + recvcnts[ntasks - 1];
+
+   if(!(*pid_rbuf = malloc((nrecv + 1) * sizeof(int))) ||
+      !(*hind_rbuf = malloc((nrecv + 1) * sizeof(long int))) ||
+      !(*mvir_rbuf = malloc((nrecv + 1) * sizeof(float))))
+   {
+      printf("Error, could not allocate memory for flagging recv buffers!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   MPI_Alltoallv(pid_sbuf, sendcnts, sdispls, MPI_INT, *pid_rbuf, recvcnts, rdispls, MPI_INT,
+                 MPI_COMM_WORLD);
+   MPI_Alltoallv(hind_sbuf, sendcnts, sdispls, MPI_LONG, *hind_rbuf, recvcnts, rdispls,
+                 MPI_LONG, MPI_COMM_WORLD);
+   MPI_Alltoallv(mvir_sbuf, sendcnts, sdispls, MPI_FLOAT, *mvir_rbuf, recvcnts, rdispls,
+                 MPI_FLOAT, MPI_COMM_WORLD);
+
+   // Make sure everything we got is ours
+   get_slab(thistask, ngas, &first_id, &n_slab);
+
+   for(i = 0; i < nrecv; i++)
+   {
+      if(((*pid_rbuf)[i] < first_id) || ((*pid_rbuf)[i] >= first_id + n_slab))
       {
-         displs[i] = i;
-         recvcnts[i] = 1;
+         printf("Error, task %d was sent pid %d, which it doesn't own!\n", thistask,
+                (*pid_rbuf)[i]);
+         exit(EXIT_FAILURE);
       }
    }
 
-   // Get max number of subhalos
-   max_subs_local = H[0].nsub;
-   for(i = 1; i < nhalos_max; i++)
+   free(pid_sbuf);
+   free(hind_sbuf);
+   free(mvir_sbuf);
+   free(sendcnts);
+   free(recvcnts);
+   free(sdispls);
+   free(rdispls);
+   free(offset);
+
+   return nrecv;
+}
+
+
+
+/***********************
+flag_halo_parts_mult_file_sets
+***********************/
+void flag_halo_parts_mult_file_sets(PARTICLE_DATA *P)
+{
+   // Flags which particles belong to halos and assigns
+   // the appropriate m_vir. In parallel this involves sending
+   // the plists to root and having root do the flagging since
+   // there isn't enough memory to give each processor it's own
+   // copy of P.
+   // The halos are flagged in their order (see set_halo_order), a round at a
+   // time: round r has halo r of every file set, wherever those are. Root
+   // takes as many rounds at once as it can without holding more than
+   // FLAG_BATCH particle ids, so the number of gathers goes with the number of
+   // particles rather than the number of halos. A task sends however many
+   // halos it has in the batch, which can be none. H is sorted by order, so
+   // each batch's halos are next to each other in H.
+
+   int i;
+   int j;
+   int k;
+   int round;
+   int last;
+   int nrounds = 0;
+   int first = 0;
+   int nbatch;
+   int nslots = 0;
+   int ntot = 0;
+   int npack;
+   int counts[2];
+   int *all_counts = NULL;
+   int *halo_cnts = NULL;
+   int *halo_displs = NULL;
+   int *plist_cnts = NULL;
+   int *plist_displs = NULL;
+   int *npart = NULL;
+   int *pack = NULL;
+   int *plist = NULL;
+   int *all_npart = NULL;
+   int *plist_start = NULL;
+   int *slot = NULL;
+   int *depth = NULL;
+   int *all_depth = NULL;
+   int *flag_depth = NULL;
+   long int batch_npart;
+   long int *round_npart = NULL;
+   long int *orders = NULL;
+   long int *all_orders = NULL;
+   float *mass_list = NULL;
+   float *all_mass = NULL;
+   int nsets;
+
+   nsets = n_halo_tasks;
+
+   // Allocate memory for gatherv arrays on root (recvbuf, recvcnts, and displs, etc)
+   if(thistask == 0)
    {
-      if(H[i].nsub > max_subs_local)
+      if(!(all_counts = calloc(2 * ntasks, sizeof(int))) ||
+         !(halo_cnts = calloc(ntasks, sizeof(int))) ||
+         !(halo_displs = calloc(ntasks, sizeof(int))) ||
+         !(plist_cnts = calloc(ntasks, sizeof(int))) ||
+         !(plist_displs = calloc(ntasks, sizeof(int))))
       {
-         max_subs_local = H[i].nsub;        
+         printf("Error, could not allocate memory for flagging counts!\n");
+         exit(EXIT_FAILURE);
       }
    }
 
-   MPI_Allreduce(&max_subs_local, &max_subs_global, 1, MPI_INT, MPI_MAX, 
-               MPI_COMM_WORLD);
+   #ifdef HIERARCHY_FLAGGING
+      get_halo_depths();
 
-   // Loop over every halo
-   for(i = 0; i < nhalos_max; i++)
-   {
-      // Check to see if halo has substructure. If it does, we need to remove
+      if(thistask == 0)
+      {
+         flag_depth = init_flag_depths(P);
+      }
+   #else
+      // Take care of the sub halos that are here but would be flagged first
+      remove_duplicates_local();
+
+      // Check to see if each halo has substructure. If it does, we need to remove
       // duplicate particles before doing the communication. The reason that we need to
       // remove duplicates in the multiple file sets case and not the single file sets
       // case is because a host and all of its subhalos are not necessarily in the same
@@ -138,108 +460,371 @@ void flag_halo_parts_mult_file_sets(PARTICLE_DATA *P)
       // is no guarantee that we'll have the subhalo plist passed to root AFTER the host,
       // as is the case for the single file set. This means a particle that's really in a
       // subhalo might end up having the m_vir of the host assigned to it because that
-      // plist just happened to be passed after the sub plist.
-      remove_duplicates(i);
+      // plist just happened to be passed after the sub plist. It's all done before any
+      // flagging.
+      remove_duplicates();
+   #endif
 
-      // For each halo, we need to send it's plist to root. This means that the memory to
-      // hold the plist needs to be allocated on root. This means root needs to know how 
-      // many particles are being sent from each processor. 
+   // Number of rounds is the length of the longest file set
+   if(nhalos_local > 0)
+   {
+      nrounds = H[nhalos_local - 1].order / nsets + 1;
+   }
 
-      // Start by sending the number of particles in the plist
-      MPI_Gatherv(&H[i].npart, 1, MPI_INT, npart_per_plist, recvcnts, displs, MPI_INT, 0,
-                  MPI_COMM_WORLD);
+   MPI_Allreduce(MPI_IN_PLACE, &nrounds, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
 
-      // Get the halo virial masses
-      MPI_Gatherv(&H[i].m_vir, 1, MPI_FLOAT, mass_list, recvcnts, displs, MPI_FLOAT, 0, 
-                  MPI_COMM_WORLD);
+   // Every task needs the number of particles in each round to agree on the
+   // batches
+   if(!(round_npart = calloc(nrounds + 1, sizeof(long int))))
+   {
+      printf("Error, could not allocate memory for round sizes!\n");
+      exit(EXIT_FAILURE);
+   }
 
-      // Now that we have the number of particles in the current halo, we can allocate 
-      // memory for the plist on root
-      if(thistask == 0)
+   for(i = 0; i < nhalos_local; i++)
+   {
+      round_npart[H[i].order / nsets] += H[i].npart;
+   }
+
+   MPI_Allreduce(MPI_IN_PLACE, round_npart, nrounds, MPI_LONG, MPI_SUM, MPI_COMM_WORLD);
+
+   for(round = 0; round < nrounds; round = last)
+   {
+      // The batch is rounds round to last - 1. It always has at least one
+      // round, however big, and no more than fit in FLAG_BATCH slots on root
+      batch_npart = round_npart[round];
+
+      for(last = round + 1; (last < nrounds) && ((last - round + 1) <= FLAG_BATCH / nsets) &&
+          (batch_npart + round_npart[last] <= FLAG_BATCH); last++)
+      {
+         batch_npart += round_npart[last];
+      }
+
+      // Pack this task's halos for the batch
+      for(nbatch = 0, npack = 0; (first + nbatch < nhalos_local) &&
+          (H[first + nbatch].order / nsets < last); nbatch++)
+      {
+         npack += H[first + nbatch].npart;
+      }
+
+      if(!(orders = malloc((nbatch + 1) * sizeof(long int))) ||
+         !(mass_list = malloc((nbatch + 1) * sizeof(float))) ||
+         !(npart = malloc((nbatch + 1) * sizeof(int))) ||
+         !(depth = malloc((nbatch + 1) * sizeof(int))) ||
+         !(pack = malloc((npack + 1) * sizeof(int))))
+      {
+         printf("Error, could not allocate memory for flagging halos!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      for(i = 0, npack = 0; i < nbatch; i++)
       {
-         totcounts = 0;
+         orders[i] = H[first + i].order;
+         mass_list[i] = H[first + i].m_vir;
+         npart[i] = H[first + i].npart;
+         depth[i] = H[first + i].depth;
+
+         memcpy(pack + npack, PLIST(first + i), H[first + i].npart * sizeof(int));
+         npack += H[first + i].npart;
+      }
+
+      first += nbatch;
 
-         for(j = 0; j < ntasks; j++)
+      // Root needs to know how many halos and particles are coming from each task
+      counts[0] = nbatch;
+      counts[1] = npack;
+
+      MPI_Gather(counts, 2, MPI_INT, all_counts, 2, MPI_INT, 0, MPI_COMM_WORLD);
+
+      if(thistask == 0)
+      {
+         for(j = 0, ntot = 0, k = 0; j < ntasks; j++)
          {
-            totcounts += npart_per_plist[j];
+            halo_cnts[j] = all_counts[2 * j];
+            plist_cnts[j] = all_counts[2 * j + 1];
+            halo_displs[j] = ntot;
+            plist_displs[j] = k;
+            ntot += halo_cnts[j];
+            k += plist_cnts[j];
          }
 
-         // Allocate memory for plist
-         if(!(plist = calloc(totcounts, sizeof(int))))
+         nslots = (last - round) * nsets;
+
+         if(!(plist = malloc((k + 1) * sizeof(int))) ||
+            !(plist_start = malloc((ntot + 1) * sizeof(int))) ||
+            !(all_orders = malloc((ntot + 1) * sizeof(long int))) ||
+            !(all_mass = malloc((ntot + 1) * sizeof(float))) ||
+            !(all_npart = malloc((ntot + 1) * sizeof(int))) ||
+            !(all_depth = malloc((ntot + 1) * sizeof(int))) ||
+            !(slot = malloc(nslots * sizeof(int))))
          {
             printf("Error, could not allocate memory for plist!\n");
             exit(EXIT_FAILURE);
          }
+      }
 
-         // Set up the displacements for the plist
-         plist_displs[0] = 0;
+      // Get the halo orders, virial masses and sizes, and then the plists
+      MPI_Gatherv(orders, nbatch, MPI_LONG, all_orders, halo_cnts, halo_displs, MPI_LONG, 0,
+                  MPI_COMM_WORLD);
+      MPI_Gatherv(mass_list, nbatch, MPI_FLOAT, all_mass, halo_cnts, halo_displs, MPI_FLOAT, 0,
+                  MPI_COMM_WORLD);
+      MPI_Gatherv(npart, nbatch, MPI_INT, all_npart, halo_cnts, halo_displs, MPI_INT, 0,
+                  MPI_COMM_WORLD);
 
-         for(j = 1; j < ntasks; j++)
-         {
-            plist_displs[j] = npart_per_plist[j - 1] + plist_displs[j - 1];
-         }
-      }
+      #ifdef HIERARCHY_FLAGGING
+         MPI_Gatherv(depth, nbatch, MPI_INT, all_depth, halo_cnts, halo_displs, MPI_INT, 0,
+                     MPI_COMM_WORLD);
+      #endif
 
-      // Now send the plists
-      MPI_Gatherv(&H[i].plist[0], H[i].npart, MPI_INT, plist, npart_per_plist, 
-                 plist_displs, MPI_INT, 0, MPI_COMM_WORLD);
+      MPI_Gatherv(pack, npack, MPI_INT, plist, plist_cnts, plist_displs, MPI_INT, 0,
+                  MPI_COMM_WORLD);
 
-      // Loop over plist
       if(thistask == 0)
       {
-         // Flag particles
-         for(j = 0; j < totcounts; j++)
+         // Where each halo's plist is, and which halo has each place in the
+         // order. Every order in the batch is between round * nsets and
+         // last * nsets, and there's at most one halo with each
+         for(j = 0; j < nslots; j++)
          {
-            if(plist[j] != -1)
-            {
-               P[plist[j] - 1].in_halo = 1;
+            slot[j] = -1;
+         }
 
-               // We can just get the virial mass here if there's only one file set
-               if(n_halo_tasks == 1)
-               {
-                  P[plist[j] - 1].m_vir = H[i].m_vir;
-               }
-            }
+         for(j = 0, k = 0; j < ntot; j++)
+         {
+            plist_start[j] = k;
+            k += all_npart[j];
+
+            slot[all_orders[j] - (long)round * nsets] = j;
          }
 
-         // Assign virial mass. We loop over every task. For every task, we loop over the
-         // number of particles sent by that task. We then assign the corresponding m to
-         // those particles. We just need l as an ever increasing index.
-         for(j = 0, l = 0; j < ntasks; j++)
+         // Flag particles and assign the virial masses
+         for(j = 0; j < nslots; j++)
          {
-            for(k = 0; k < npart_per_plist[j]; k++)
+            if((i = slot[j]) < 0)
+            {
+               continue;
+            }
+
+            for(k = 0; k < all_npart[i]; k++)
             {
-               // Skip the ghostlos
-               if(plist[l] != -1)
-               {   
-                  P[plist[l] - 1].m_vir = mass_list[j];
+               // Skip the removed duplicates
+               if(plist[plist_start[i] + k] != -1)
+               {
+                  #ifdef HIERARCHY_FLAGGING
+                     if(!claim_particle(flag_depth, plist[plist_start[i] + k] - 1,
+                                        all_depth[i]))
+                     {
+                        continue;
+                     }
+                  #endif
+
+                  SET_IN_HALO(P->in_halo, plist[plist_start[i] + k] - 1);
+                  P->m_vir[plist[plist_start[i] + k] - 1] = all_mass[i];
                }
-               l++;
-            } 
+            }
          }
 
-         // Free the plist for the next halo. If there's only one file set, plist only
-         // exists on root
-         if(thistask == 0)
-         {
-            free(plist);
-         }
+         free(plist);
+         free(plist_start);
+         free(all_orders);
+         free(all_mass);
+         free(all_npart);
+         free(all_depth);
+         free(slot);
       }
+
+      free(orders);
+      free(mass_list);
+      free(npart);
+      free(depth);
+      free(pack);
    }
 
+   free(round_npart);
+   free(flag_depth);
+
    // Free memory for gatherv arrays
    if(thistask == 0)
    {
-      free(npart_per_plist);
-      free(recvcnts);
-      free(displs);
+      free(all_counts);
+      free(halo_cnts);
+      free(halo_displs);
+      free(plist_cnts);
       free(plist_displs);
-      free(mass_list);
    }
 }
 
 
 
+/***********************
+    get_halo_depths
+***********************/
+void get_halo_depths(void)
+{
+   // Sets the depth of each of this task's halos: 0 for a halo without a host,
+   // 1 for a sub halo of one of those, and so on, following host_id. With one
+   // file set root has every halo, so H is the whole tree. Otherwise every
+   // task gets the id and host of every sub halo, wherever it is, with one
+   // MPI_Allgatherv. The halos without hosts aren't needed for that, since a
+   // chain stops at the first host that isn't a sub halo. Collective with
+   // more than one file set.
+
+   int i;
+   int k;
+   int n = 0;
+   int ntree;
+   int *counts = NULL;
+   int *displs = NULL;
+   long int host;
+   long int *pairs = NULL;
+   long int *all_pairs = NULL;
+   HALO_DATA *tree;
+   HALO_INDEX sub_index = {0, NULL, NULL};
+   HALO_INDEX *tree_index;
+
+   tree = H;
+   ntree = nhalos_local;
+   tree_index = &halo_index;
+
+   if(n_halo_tasks != 1)
+   {
+      if(!(counts = calloc(ntasks, sizeof(int))) || !(displs = calloc(ntasks, sizeof(int))) ||
+         !(pairs = malloc((2 * nhalos_local + 1) * sizeof(long int))))
+      {
+         printf("Error, could not allocate memory for halo depths!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      for(i = 0; i < nhalos_local; i++)
+      {
+         if(H[i].host_id != 0)
+         {
+            pairs[n++] = H[i].hid;
+            pairs[n++] = H[i].host_id;
+         }
+      }
+
+      MPI_Allgather(&n, 1, MPI_INT, counts, 1, MPI_INT, MPI_COMM_WORLD);
+
+      for(i = 1; i < ntasks; i++)
+      {
+         displs[i] = displs[i - 1] + counts[i - 1];
+      }
+
+      ntree = (displs[ntasks - 1] + counts[ntasks - 1]) / 2;
+
+      if(!(all_pairs = malloc((2 * ntree + 1) * sizeof(long int))) ||
+         !(tree = calloc(ntree + 1, sizeof(HALO_DATA))))
+      {
+         printf("Error, could not allocate memory for halo depths!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      MPI_Allgatherv(pairs, n, MPI_LONG, all_pairs, counts, displs, MPI_LONG, MPI_COMM_WORLD);
+
+      for(i = 0; i < ntree; i++)
+      {
+         tree[i].hid = all_pairs[2 * i];
+         tree[i].host_id = all_pairs[2 * i + 1];
+      }
+
+      build_halo_index(&sub_index, tree, ntree);
+      tree_index = &sub_index;
+   }
+
+   // A chain longer than the tree has to have gone round in a loop
+   for(i = 0; i < nhalos_local; i++)
+   {
+      H[i].depth = 0;
+
+      for(host = H[i].host_id; (host != 0) && (H[i].depth <= ntree);)
+      {
+         H[i].depth++;
+
+         k = find_halo(tree_index, host);
+         host = (k >= 0) ? tree[k].host_id : 0;
+      }
+   }
+
+   if(n_halo_tasks != 1)
+   {
+      free_halo_index(&sub_index);
+      free(tree);
+      free(all_pairs);
+      free(pairs);
+      free(counts);
+      free(displs);
+   }
+}
+
+
+
+/***********************
+      get_flag_key
+***********************/
+long int get_flag_key(int i)
+{
+   // What decides which of the halos a particle is in gives it its m_vir when
+   // the flagging isn't done halo by halo (see route_halo_pids): the biggest
+   // key wins. That's normally the last halo in the flagging order, and with
+   // HIERARCHY_FLAGGING the deepest halo, and then the last one of those
+
+   #ifdef HIERARCHY_FLAGGING
+      return H[i].depth * FLAG_DEPTH_STRIDE + H[i].order;
+   #else
+      return H[i].order;
+   #endif
+}
+
+
+
+/***********************
+    init_flag_depths
+***********************/
+int *init_flag_depths(PARTICLE_DATA *P)
+{
+   // Gives back an array with the depth of the halo that flagged each of P's
+   // particles so far, for claim_particle, with none flagged yet
+
+   int i;
+   int *flag_depth;
+
+   if(!(flag_depth = malloc((P->n + 1) * sizeof(int))))
+   {
+      printf("Error, could not allocate memory for flag depths!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < P->n; i++)
+   {
+      flag_depth[i] = -1;
+   }
+
+   return flag_depth;
+}
+
+
+
+/***********************
+     claim_particle
+***********************/
+int claim_particle(int *flag_depth, int index, int depth)
+{
+   // Whether a halo at depth, flagged after every halo that's been flagged so
+   // far, gets particle index. It does unless a deeper one has it already
+
+   if(depth < flag_depth[index])
+   {
+      return 0;
+   }
+
+   flag_depth[index] = depth;
+
+   return 1;
+}
+
+
+
 /***********************
 flag_halo_parts_single_file_set
 ***********************/
@@ -251,6 +836,7 @@ void flag_halo_parts_single_file_set(PARTICLE_DATA *P)
 
    int i;
    int j;
+   int *flag_depth = NULL;
 
    #ifdef PROFILING
       clock_t start;
@@ -261,8 +847,13 @@ void flag_halo_parts_single_file_set(PARTICLE_DATA *P)
 
    if(thistask == 0)
    {
+      #ifdef HIERARCHY_FLAGGING
+         get_halo_depths();
+         flag_depth = init_flag_depths(P);
+      #endif
+
       // Loop over every halo
-      for(i = 0; i < nhalos_max; i++)
+      for(i = 0; i < nhalos_local; i++)
       {
         printf("Flagging particles for halo %ld\n", H[i].hid);
 
@@ -271,8 +862,9 @@ void flag_halo_parts_single_file_set(PARTICLE_DATA *P)
             // Get start time
             start = clock();
          #endif
-         //remove_duplicates_single_set_optimized(i);
-         remove_duplicates_single_set(i);
+         #ifndef HIERARCHY_FLAGGING
+            remove_duplicates_single_set(i);
+         #endif
 
          #ifdef PROFILING
             // Get end time
@@ -290,10 +882,17 @@ void flag_halo_parts_single_file_set(PARTICLE_DATA *P)
          for(j = 0; j < H[i].npart; j++)
          {
             // Flag particles
-            if(H[i].plist[j] != -1)
+            if(PLIST(i)[j] != -1)
             {
-               P[H[i].plist[j] - 1].in_halo = 1;
-               P[H[i].plist[j] - 1].m_vir = H[i].m_vir;
+               #ifdef HIERARCHY_FLAGGING
+                  if(!claim_particle(flag_depth, PLIST(i)[j] - 1, H[i].depth))
+                  {
+                     continue;
+                  }
+               #endif
+
+               SET_IN_HALO(P->in_halo, PLIST(i)[j] - 1);
+               P->m_vir[PLIST(i)[j] - 1] = H[i].m_vir;
             }
          }
 
@@ -311,6 +910,8 @@ void flag_halo_parts_single_file_set(PARTICLE_DATA *P)
          printf("Total time spent removing duplicates: %e secs\n", tot_remove_duplicates);
          printf("Total time spent flagging: %e secs\n", tot_flag);
       #endif
+
+      free(flag_depth);
    }
 }
 
@@ -324,14 +925,14 @@ void flag(PARTICLE_DATA *P)
    int i;
    int j;
 
-   for(i = 0; i < nhalos_max; i++)
+   for(i = 0; i < nhalos_local; i++)
    {
       if(thistask == 0)
       {
          for(j = 0; j < H[i].npart; j++)
          {
-            P[H[i].plist[j] - 1].in_halo = 1;
-            P[H[i].plist[j]-1].m_vir = H[i].m_vir;
+            SET_IN_HALO(P->in_halo, PLIST(i)[j] - 1);
+            P->m_vir[PLIST(i)[j] - 1] = H[i].m_vir;
          }
       }
    }
@@ -342,7 +943,7 @@ void flag(PARTICLE_DATA *P)
 /***********************
    remove_duplicates
 ***********************/
-void remove_duplicates(int current)
+void remove_duplicates(void)
 {
    // Driver function for removing particles in a subhalo from the host halo's
    // plist. This is only necessary to do because some subhalos reside on a
@@ -350,182 +951,369 @@ void remove_duplicates(int current)
    // subhalo to get flagged on root before the host, which would overwrite the
    // subhalo's m_vir with the host's m_vir, which is bad, as it screws up the
    // temperature calculation.
+   // It's done for every halo at once. Every task's missing sub halo ids go to
+   // every task with one MPI_Allgatherv, since nobody knows where they are. Each
+   // task that has one sends its hid, host and plist back, all in one go, so the
+   // number of messages doesn't depend on the number of halos. The replies carry
+   // the hids, so every header uses REMOVE_DUPLICATES_TAG and every plist uses
+   // REMOVE_DUPLICATES_PLIST_TAG, and each task's are dealt with as soon as
+   // they've arrived (see remove_replied_duplicates). The plists are all sent
+   // before any are changed. Collective.
 
    int i;
    int j;
+   int t;
    int k;
-   int l;
-   int host_index;
-   long int host_id;
-   int tag;
-   long int tag_long;
+   int done;
    int n_mia_local = 0;
-   int npart_in_mia = 0;
-   int n_mia_subids_sent;
-   int *mia_plist = NULL;
+   int n_mia = 0;
+   int nreq;
+   int nreply;
+   int nplist;
+   int *mia_cnts;
+   int *mia_displs;
+   int *head_scnts;
+   int *head_sdispls;
+   int *head_rcnts;
+   int *head_rdispls;
+   int *plist_scnts;
+   int *plist_sdispls;
+   int *plist_rcnts;
+   int *plist_rdispls;
+   int *plist_sbuf;
+   int *plist_rbuf;
+   int *nwaiting;
    long int *mia_subids_local = NULL;
-   long int *mia_subids_rbuf = NULL;
-   MPI_Status status;
+   long int *mia_subids;
+   long int *subids;
+   long int *head_sbuf;
+   long int *head_rbuf;
+   MPI_Request *reqs;
+
+   if(!(mia_cnts = calloc(ntasks, sizeof(int))) || !(mia_displs = calloc(ntasks, sizeof(int))) ||
+      !(head_scnts = calloc(ntasks, sizeof(int))) ||
+      !(head_sdispls = calloc(ntasks, sizeof(int))) ||
+      !(head_rcnts = calloc(ntasks, sizeof(int))) ||
+      !(head_rdispls = calloc(ntasks, sizeof(int))) ||
+      !(plist_scnts = calloc(ntasks, sizeof(int))) ||
+      !(plist_sdispls = calloc(ntasks, sizeof(int))) ||
+      !(plist_rcnts = calloc(ntasks, sizeof(int))) ||
+      !(plist_rdispls = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for removing duplicates!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   // Get list of missing subhalo ids on current processor, for every halo
+   for(i = 0; i < nhalos_local; i++)
+   {
+      subids = get_mia_subs(i, &n_mia);
+
+      if(n_mia > 0)
+      {
+         if(!(mia_subids_local = realloc(mia_subids_local,
+                                         (n_mia_local + n_mia) * sizeof(long int))))
+         {
+            printf("Error, could not allocate memory for mia_subids!\n");
+            exit(EXIT_FAILURE);
+         }
+
+         memcpy(mia_subids_local + n_mia_local, subids, n_mia * sizeof(long int));
+         n_mia_local += n_mia;
+      }
+
+      free(subids);
+   }
+
+   // Everyone gets everyone's list
+   MPI_Allgather(&n_mia_local, 1, MPI_INT, mia_cnts, 1, MPI_INT, MPI_COMM_WORLD);
+
+   for(t = 1; t < ntasks; t++)
+   {
+      mia_displs[t] = mia_displs[t - 1] + mia_cnts[t - 1];
+   }
+
+   nreq = mia_displs[ntasks - 1] + mia_cnts[ntasks - 1];
 
-   // Allocate for rbuf. This is memory inefficient, but I don't really care at
-   // this point. I'll change it if I have to
-   if(!(mia_subids_rbuf = calloc(max_subs_global, sizeof(long int))))
+   if(!(mia_subids = malloc((nreq + 1) * sizeof(long int))))
    {
-      printf("Error, could not allocate memory for mia_subids_rbuf!\n");
+      printf("Error, could not allocate memory for mia_subids!\n");
       exit(EXIT_FAILURE);
    }
 
-   // Get list of missing subhalo ids on current processor
-   mia_subids_local = get_mia_subs(current, &n_mia_local);
+   MPI_Allgatherv(mia_subids_local, n_mia_local, MPI_LONG, mia_subids, mia_cnts, mia_displs,
+                  MPI_LONG, MPI_COMM_WORLD);
 
-   // Need every processor to send
-   for(i = 0; i < ntasks; i++)
+   // Count what goes back to each task. A reply is the sub halo's id, its host
+   // and its number of particles, followed by its plist in the other buffer
+   for(t = 0; t < ntasks; t++)
    {
-      // This processor's turn to send
-      if(i == thistask)
+      if(t == thistask)
+      {
+         continue;
+      }
+
+      for(j = mia_displs[t]; j < mia_displs[t] + mia_cnts[t]; j++)
       {
-         // Current processor needs to send to every other processor
-         for(j = 0; j < ntasks; j++)
+         if((k = find_halo(&halo_index, mia_subids[j])) >= 0)
          {
-            // Don't send to itself
-            if(thistask != j)
-            {
-               MPI_Send(mia_subids_local, n_mia_local, MPI_LONG, j, 0, 
-                        MPI_COMM_WORLD);
-            }
+            head_scnts[t] += 3;
+            plist_scnts[t] += H[k].npart;
          }
+      }
+   }
+
+   for(t = 1; t < ntasks; t++)
+   {
+      head_sdispls[t] = head_sdispls[t - 1] + head_scnts[t - 1];
+      plist_sdispls[t] = plist_sdispls[t - 1] + plist_scnts[t - 1];
+   }
 
-         // Now we need to wait for the other processors to send the plists of the
-         // missing halos back to current task. Each mia halo might be on a different
-         // processor than the others, but there has to be n_mia_local recvs (one for
-         // each mia halo)
-         for(j = 0; j < n_mia_local; j++)
+   if(!(head_sbuf = malloc((head_sdispls[ntasks - 1] + head_scnts[ntasks - 1] + 1) *
+                           sizeof(long int))) ||
+      !(plist_sbuf = malloc((plist_sdispls[ntasks - 1] + plist_scnts[ntasks - 1] + 1) *
+                            sizeof(int))))
+   {
+      printf("Error, could not allocate memory for removing duplicates!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(t = 0, nreply = 0, nplist = 0; t < ntasks; t++)
+   {
+      if(t == thistask)
+      {
+         continue;
+      }
+
+      for(j = mia_displs[t]; j < mia_displs[t] + mia_cnts[t]; j++)
+      {
+         if((k = find_halo(&halo_index, mia_subids[j])) >= 0)
          {
-            // I'm tagging the message with the mia halo id because many different 
-            // processors could be sending back here all at the same time, and if 
-            // every message has the same tag, does that mess things up? Or does 
-            // MPI queue them and then accept them in order?
-            
-            // The mpi tag must be an int, but the hids are long ints and generally
-            // larger than INT_MAX. As such, to keep the tag (not even sure if I
-            // have to) corresponding to the halo id, I can subtract off INT_MAX
-            // until we're less than INT_MAX.
-            tag_long = mia_subids_local[j];
-            while(tag_long > INT_MAX)
-            {
-               tag_long -= INT_MAX;
-            }
+            head_sbuf[nreply++] = H[k].hid;
+            head_sbuf[nreply++] = H[k].host_id;
+            head_sbuf[nreply++] = H[k].npart;
 
-            // I don't think this cast is necessary, but I don't really care
-            tag = tag_long;
+            memcpy(plist_sbuf + nplist, PLIST(k), H[k].npart * sizeof(int));
+            nplist += H[k].npart;
+         }
+      }
+   }
 
-            MPI_Recv(&npart_in_mia, 1, MPI_INT, MPI_ANY_SOURCE,
-                     tag, MPI_COMM_WORLD, &status);
+   MPI_Alltoall(head_scnts, 1, MPI_INT, head_rcnts, 1, MPI_INT, MPI_COMM_WORLD);
+   MPI_Alltoall(plist_scnts, 1, MPI_INT, plist_rcnts, 1, MPI_INT, MPI_COMM_WORLD);
 
-            // Allocate memory for plist
-            if(!(mia_plist = calloc(npart_in_mia, sizeof(int))))
-            {
-               printf("Error, could not allocate memory for mia_plist!\n");
-               exit(EXIT_FAILURE);
-            }
+   for(t = 1; t < ntasks; t++)
+   {
+      head_rdispls[t] = head_rdispls[t - 1] + head_rcnts[t - 1];
+      plist_rdispls[t] = plist_rdispls[t - 1] + plist_rcnts[t - 1];
+   }
 
-            MPI_Recv(mia_plist, npart_in_mia, MPI_INT, MPI_ANY_SOURCE, 
-                     tag, MPI_COMM_WORLD, &status);
+   nreply = head_rdispls[ntasks - 1] + head_rcnts[ntasks - 1];
+   nplist = plist_rdispls[ntasks - 1] + plist_rcnts[ntasks - 1];
 
-            // Receive the host id
-            MPI_Recv(&host_id, 1, MPI_LONG, MPI_ANY_SOURCE, tag, 
-                     MPI_COMM_WORLD, &status);
+   if(!(head_rbuf = malloc((nreply + 1) * sizeof(long int))) ||
+      !(plist_rbuf = malloc((nplist + 1) * sizeof(int))))
+   {
+      printf("Error, could not allocate memory for removing duplicates!\n");
+      exit(EXIT_FAILURE);
+   }
 
-            // Now that we have the plist of the mia halo, we can go through its host
-            // plist and remove the duplicates. 
-            // Find host index
-            for(k = 0; k < nhalos_local; k++)
-            {
-               // This does not work, as the mia halo id is not on this processor,
-               // which is why I had to send for it in the first place.
-               if(host_id == H[k].hid)
-               {
-                  host_index = k;
-                  break;
-               }
-            }
-        
-            for(k = 0; k < npart_in_mia; k++)
-            {
-               for(l = 0; l < H[host_index].npart; l++)
-               {
-                  if(mia_plist[k] == H[host_index].plist[l])
-                  {
-                     // Here if there's a duplicate. Flag it as being one
-                     H[host_index].plist[l] = -1;
-                     break;
-                  }
-               }
-            }
+   // At most one header and one plist come from and go to each task. The
+   // receives are reqs[0] to reqs[2 * ntasks - 1], header then plist for each
+   // task, and the sends are the 2 * ntasks after them
+   if(!(reqs = malloc(4 * ntasks * sizeof(MPI_Request))) ||
+      !(nwaiting = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for removing duplicates!\n");
+      exit(EXIT_FAILURE);
+   }
 
-            // Free
-            free(mia_plist);
-         }
+   // Receive every task's replies. The headers and the plists have tags of
+   // their own, so each one lands in the right place whatever order they come in
+   for(t = 0; t < ntasks; t++)
+   {
+      reqs[2 * t] = MPI_REQUEST_NULL;
+      reqs[2 * t + 1] = MPI_REQUEST_NULL;
+
+      if(head_rcnts[t] > 0)
+      {
+         MPI_Irecv(head_rbuf + head_rdispls[t], head_rcnts[t], MPI_LONG, t,
+                   REMOVE_DUPLICATES_TAG, MPI_COMM_WORLD, &reqs[2 * t]);
+         nwaiting[t]++;
       }
 
-      else
+      if(plist_rcnts[t] > 0)
       {
-         // All the other processors need to listen for the current processor's list of 
-         // mia subids
-         MPI_Recv(mia_subids_rbuf, max_subs_global, MPI_LONG, MPI_ANY_SOURCE, 0, 
-                  MPI_COMM_WORLD, &status);
+         MPI_Irecv(plist_rbuf + plist_rdispls[t], plist_rcnts[t], MPI_INT, t,
+                   REMOVE_DUPLICATES_PLIST_TAG, MPI_COMM_WORLD, &reqs[2 * t + 1]);
+         nwaiting[t]++;
+      }
+   }
 
-         // Now we get the number of mia halos sent
-         MPI_Get_count(&status, MPI_LONG, &n_mia_subids_sent);
+   for(t = 0; t < ntasks; t++)
+   {
+      reqs[2 * ntasks + 2 * t] = MPI_REQUEST_NULL;
+      reqs[2 * ntasks + 2 * t + 1] = MPI_REQUEST_NULL;
 
-         // Now search to see if current processor contains any of the sending processor's
-         //  mia halos
-         for(j = 0; j < n_mia_subids_sent; j++)
-         {
-            for(k = 0; k < nhalos_local; k++)
-            {
-               if(mia_subids_rbuf[j] == H[k].hid)
-               {
-                  // We found one! Now we have to send the plist back to the sending 
-                  // processor. MPI_Send sends a copy of the data (as far as I can 
-                  // tell from my testing), which means that I don't need to send 
-                  // the plist back from the searching processor to here, as the mia 
-                  // halo plist will never get modified. It's only the host plist 
-                  // (which resides on the searching processor) that gets changed. 
+      if(head_scnts[t] > 0)
+      {
+         MPI_Isend(head_sbuf + head_sdispls[t], head_scnts[t], MPI_LONG, t,
+                   REMOVE_DUPLICATES_TAG, MPI_COMM_WORLD, &reqs[2 * ntasks + 2 * t]);
+      }
+
+      if(plist_scnts[t] > 0)
+      {
+         MPI_Isend(plist_sbuf + plist_sdispls[t], plist_scnts[t], MPI_INT, t,
+                   REMOVE_DUPLICATES_PLIST_TAG, MPI_COMM_WORLD, &reqs[2 * ntasks + 2 * t + 1]);
+      }
+   }
 
+   // Now that we have the plists of the mia halos, we can go through their hosts'
+   // plists and remove the duplicates, a task's worth at a time in whatever order
+   // they finish arriving
+   for(;;)
+   {
+      MPI_Waitany(2 * ntasks, reqs, &done, MPI_STATUS_IGNORE);
 
-                  // Get remapped id to use as tag. See above
-                  tag_long = H[k].hid;
+      if(done == MPI_UNDEFINED)
+      {
+         break;
+      }
 
-                  while(tag_long > INT_MAX)
-                  {
-                     tag_long -= INT_MAX;
-                  }
+      t = done / 2;
 
-                  tag = tag_long;
+      if(--nwaiting[t] == 0)
+      {
+         remove_replied_duplicates(head_rbuf + head_rdispls[t], head_rcnts[t] / 3,
+                                   plist_rbuf + plist_rdispls[t]);
+      }
+   }
 
-                  // Send number of particles
-                  MPI_Send(&H[k].npart, 1, MPI_INT, status.MPI_SOURCE, tag, 
-                           MPI_COMM_WORLD);
+   MPI_Waitall(2 * ntasks, reqs + 2 * ntasks, MPI_STATUSES_IGNORE);
 
-                  // Send the plist
-                  MPI_Send(H[k].plist, H[k].npart, MPI_INT, status.MPI_SOURCE, 
-                           tag, MPI_COMM_WORLD);
+   free(mia_subids_local);
+   free(mia_subids);
+   free(head_sbuf);
+   free(head_rbuf);
+   free(plist_sbuf);
+   free(plist_rbuf);
+   free(mia_cnts);
+   free(mia_displs);
+   free(head_scnts);
+   free(head_sdispls);
+   free(head_rcnts);
+   free(head_rdispls);
+   free(plist_scnts);
+   free(plist_sdispls);
+   free(plist_rcnts);
+   free(plist_rdispls);
+   free(nwaiting);
+   free(reqs);
+}
 
-                  // Send the host
-                  MPI_Send(&H[k].host_id, 1, MPI_LONG, status.MPI_SOURCE, tag, 
-                           MPI_COMM_WORLD);
 
-                  break;
-               }
-            }
-         }
+
+/***********************
+remove_replied_duplicates
+***********************/
+void remove_replied_duplicates(long int *head, int nreply, int *plist)
+{
+   // Takes the particles of the nreply sub halos one task sent back in
+   // remove_duplicates out of their hosts. head has each sub halo's id, host
+   // and number of particles, and plist has their plists one after the other.
+   // The host is always here, since it's the one that asked
+
+   int j;
+   int host;
+   long int nplist = 0;
+
+   for(j = 0; j < nreply; j++)
+   {
+      if((host = find_halo(&halo_index, head[3 * j + 1])) < 0)
+      {
+         printf("Error, task %d could not find host halo %ld of sub halo %ld!\n", thistask,
+                head[3 * j + 1], head[3 * j]);
+         exit(EXIT_FAILURE);
       }
+
+      remove_plist_overlap(host, plist + nplist, head[3 * j + 2]);
+      nplist += head[3 * j + 2];
    }
+}
 
-   // Free
-   free(mia_subids_local);
-   free(mia_subids_rbuf);
+
+
+/***********************
+  remove_plist_overlap
+***********************/
+void remove_plist_overlap(int host, int *plist, int npart)
+{
+   // Takes the npart particles in plist out of halo host's plist by making them
+   // -1. Both are sorted, apart from the -1s, so they're walked together once
+
+   int j;
+   int l;
+
+   for(j = 0, l = 0; (j < H[host].npart) && (l < npart);)
+   {
+      if(PLIST(host)[j] == -1)
+      {
+         j++;
+      }
+
+      else if((plist[l] == -1) || (plist[l] < PLIST(host)[j]))
+      {
+         l++;
+      }
+
+      else if(PLIST(host)[j] < plist[l])
+      {
+         j++;
+      }
+
+      else
+      {
+         PLIST(host)[j] = -1;
+         j++;
+         l++;
+      }
+   }
+}
+
+
+
+/***********************
+remove_duplicates_local
+***********************/
+void remove_duplicates_local(void)
+{
+   // remove_duplicates only takes care of the sub halos that aren't on the
+   // same task as their host. The ones that are don't need it when the task
+   // has one file set, since they're further down H than their hosts and get
+   // flagged after them. When a task has more than one set (see halo_sets.c),
+   // a sub halo can be further up H than its host, or its host's host, and
+   // so on, so its particles are taken out of each of those here instead. The
+   // hosts are followed through host_id for as long as they're on this task.
+
+   int i;
+   int host;
+
+   if(halo_set_count < 2)
+   {
+      return;
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      for(host = find_halo(&halo_index, H[i].host_id); host >= 0;
+          host = find_halo(&halo_index, H[host].host_id))
+      {
+         if(host > i)
+         {
+            remove_plist_overlap(host, PLIST(i), H[i].npart);
+         }
+      }
+   }
 }
 
 
@@ -558,18 +1346,13 @@ long int *get_mia_subs(int current, int *n_mia_local)
    // Loop over every subhalo
    for(i = 0; i < H[current].nsub; i++)
    {
-      // Now loop over every halo in the current processor's set
-      for(j = 0; j < nhalos_local; j++)
+      // Check for it in the current processor's set
+      if(find_halo(&halo_index, SUBLIST(current)[i]) >= 0)
       {
-         // Check for a match
-         if(H[j].hid == H[current].sublist[i])
-         {
-            // We're here if the subhalo is in the file set, so we flag it as found
-            // and then decrement the number of missing.
-            found[i] = 1;
-            *n_mia_local -= 1;
-            break;
-         }
+         // We're here if the subhalo is in the file set, so we flag it as found
+         // and then decrement the number of missing.
+         found[i] = 1;
+         *n_mia_local -= 1;
       }
    }
 
@@ -589,7 +1372,7 @@ long int *get_mia_subs(int current, int *n_mia_local)
       {
          if(found[i] == 0)
          {
-            mia_subids[j] = H[current].sublist[i];
+            mia_subids[j] = SUBLIST(current)[i];
             j++;
          }
       }
@@ -603,106 +1386,127 @@ long int *get_mia_subs(int current, int *n_mia_local)
 
 
 /***********************
-remove_duplicates_single_set_optimized
+remove_duplicates_single_set
 ***********************/
-void remove_duplicates_single_set_optimized(int current)
+void remove_duplicates_single_set(int current)
 {
    // Removes those particles that are in the first subhalo
    // level down from the current halo's plist. This is taken from the serial version
-   // of this code. 
-   // The halos are sorted in the halos file by mass, and it's impossible
-   // for a subhalo to be more massive than its host, which means that the subhalos
-   // will always be further down the list (read: at a higher index of H[]) than
-   // H[current], so we can start our search for the subhalo at H[current + 1].
+   // of this code.
+   // Every plist is sorted (see sort_plist), so each subhalo is merged with the
+   // host in one pass, or, when it's much smaller than the host, each of its
+   // particles is looked for in the host with a binary search. A subhalo's
+   // particles don't all have to be in its host. The ones that are get
+   // negated, which keeps the host sorted by absolute value while the rest of
+   // the subhalos are done, and then become -1. Each halo is only done once, so
+   // the host doesn't have any -1s yet, but a subhalo might.
 
    int i;
    int j;
    int k;
+   int lo;
+   int hi;
+   int mid;
    int sub_ind;
-   int max_iters;
+   int log_n;
+   int found = 0;
+   int nhost;
+   int nsub;
+   int *host;
+   int *sub;
 
-   // If current is the last halo, then there's no point in looking because this
-   // halo (H[current]) cannot have any subhalos since it's last in the list and they're
-   // sorted by mass and a subhalo must be less massive than its host, which means it
-   // will be futher down the list, which, if this is the last element, doesn't exist
-   if(current == nhalos_max - 1)
+   host = PLIST(current);
+   nhost = H[current].npart;
+
+   for(log_n = 1; (nhost >> log_n) > 0; log_n++)
    {
-      return;
+      continue;
    }
 
-   // Set our starting index to the current halo
-   sub_ind = current;
-
    // Loop over the subhalos
    for(i = 0; i < H[current].nsub; i++)
    {
-      // The closest the subhalo could be is the next element in the H array
-      sub_ind = sub_ind + 1;
-
-      // Reset the max iters counter
-      max_iters = 0;
-
       // Find subhalo
-      while(H[sub_ind].hid != H[current].sublist[i])
+      if((sub_ind = find_halo(&halo_index, SUBLIST(current)[i])) < 0)
       {
-         sub_ind++;
-         max_iters++;
+         printf("Error, could not find subhalo when removing duplicates! Halo: %d, \
+            sublist entry: %d\n", current, i);
+         free_halos();
+
+         exit(EXIT_FAILURE);
+      }
 
-         // Check max iters to avoid potential infinite loop
-         if(max_iters > nhalos_max)
+      sub = PLIST(sub_ind);
+      nsub = H[sub_ind].npart;
+
+      // Merge the two plists. A pid that's in the host more than once is
+      // removed every time
+      if((long)nsub * log_n >= nhost)
+      {
+         for(j = 0, k = 0; (j < nhost) && (k < nsub);)
          {
-            printf("Error, maximum number of iterations reached when removing \
-               duplicates! Halo: %d, sublist entry: %d\n", current, i);
-            for(i = 0; i < nhalos_max; i++)
+            if((sub[k] == -1) || (sub[k] < abs(host[j])))
             {
-               free(H[i].plist);
-               free(H[i].sublist);
+               k++;
             }
-            free(H);
 
-            exit(EXIT_FAILURE);
+            else if(abs(host[j]) < sub[k])
+            {
+               j++;
+            }
+
+            else
+            {
+               host[j] = -sub[k];
+               found = 1;
+               j++;
+            }
          }
       }
 
-      // Loop over every particle in current and compare to subhalo
-      for(j = 0, k = 0; j < H[current].npart; j++)
+      // Look for each of the subhalo's particles in the host
+      else
       {
-         // We don't need to loop over the whole sub_ind plist. Since they're sorted,
-         // if H[sub_ind].plist[k] > H[current].plist[j], then we're done, plist[j] is
-         // not in H[sub_ind].plist.
-         if(H[current].plist[j] < H[sub_ind].plist[k])
+         for(k = 0; k < nsub; k++)
          {
-            continue;
-         }
+            if(sub[k] == -1)
+            {
+               continue;
+            }
 
-         if(H[current].plist[j] == H[sub_ind].plist[k])
-         {
-            // Flag as a duplicate by changing its id to -1
-            H[current].plist[j] = -1;
+            for(lo = 0, hi = nhost; lo < hi;)
+            {
+               mid = lo + (hi - lo) / 2;
 
-            // Now set k_start to k + 1 so we don't re-loop over elements that we know
-            // cannot 
-            k++;
-            continue;
-         }
+               if(abs(host[mid]) < sub[k])
+               {
+                  lo = mid + 1;
+               }
 
-         // The only way that H[sub_ind].plist[k] < H[current].plist[j] is if we've
-         // reached the end of plist[k] but not plist[j]. That is, if
-         // H[current].plist = [1,2,17,19,20,33,43,51,57,68] 
-         // and H[sub_ind].plist = [17,20,57], then when k is 2 the pid is 57, but we
-         // still have pid 68 left in the host plist. This is our exit condition
-         if(H[current].plist[j] > H[sub_ind].plist[k])
-         {
-            break;
+               else
+               {
+                  hi = mid;
+               }
+            }
+
+            for(; (lo < nhost) && (abs(host[lo]) == sub[k]); lo++)
+            {
+               host[lo] = -sub[k];
+               found = 1;
+            }
          }
       }
+   }
 
-      // We can check to make sure every particle in the subhalo was found
-      if(k != H[sub_ind].npart)
+   // Flag the duplicates by changing their ids to -1
+   if(found)
+   {
+      for(j = 0; j < nhost; j++)
       {
-         printf("Error, did not remove all duplicates from halo index: %d, \
-            sub halo index: %d\n", current, sub_ind);
-         exit(EXIT_FAILURE);
+         if(host[j] < 0)
+         {
+            host[j] = -1;
+         }
       }
    }
 }
@@ -710,46 +1514,30 @@ void remove_duplicates_single_set_optimized(int current)
 
 
 /***********************
-remove_duplicates_single_set
+remove_duplicates_single_set_brute
 ***********************/
-void remove_duplicates_single_set(int current)
+void remove_duplicates_single_set_brute(int current)
 {
-   // Removes those particles that are in the first subhalo
-   // level down from the current halo's plist. This is taken from the serial version
-   // of this code
+   // Does the same as remove_duplicates_single_set by comparing every particle
+   // in the host with every particle in each subhalo. It's kept to check the
+   // other against (see benchmark_remove_duplicates)
 
    int i;
    int j;
    int k;
    int sub_ind;
-    int max_iters;
 
    // Loop over the subhalos
    for(i = 0; i < H[current].nsub; i++)
    {
-      sub_ind = 0;
-    max_iters = 0;
-
       // Find subhalo
-      while(H[sub_ind].hid != H[current].sublist[i])
+      if((sub_ind = find_halo(&halo_index, SUBLIST(current)[i])) < 0)
       {
-         sub_ind++;
-         max_iters++;
+         printf("Error, could not find subhalo when removing duplicates! Halo: %d, \
+            sublist entry: %d\n", current, i);
+         free_halos();
 
-         // Check max iters to avoid potential infinite loop
-         if(max_iters > nhalos_max)
-         {
-            printf("Error, maximum number of iterations reached when removing \
-               duplicates! Halo: %d, sublist entry: %d\n", current, i);
-            for(i = 0; i < nhalos_max; i++)
-            {
-               free(H[i].plist);
-               free(H[i].sublist);
-            }
-            free(H);
-
-            exit(EXIT_FAILURE);
-         }
+         exit(EXIT_FAILURE);
       }
 
       // Loop over every particle in current and compare to subhalo
@@ -757,11 +1545,11 @@ void remove_duplicates_single_set(int current)
       {
          for(k = 0; k < H[sub_ind].npart; k++)
          {
-            if(H[current].plist[j] == H[sub_ind].plist[k])
+            if(PLIST(current)[j] == PLIST(sub_ind)[k])
             {
                // Flag as a duplicate by changing its id to -1
-               H[current].plist[j] = -1;
-               continue;
+               PLIST(current)[j] = -1;
+               break;
             }
          }
       }
@@ -0,0 +1,324 @@
+/************************************************
+Title: halo_cache.c
+Purpose: Contains functions for keeping a binary
+         copy of an AHF file set next to it so that
+         reruns don't have to parse the ascii files
+Notes:   * Only used with HALO_CACHE. The cache is
+           written the first time a file set is read
+           and mapped on every run after that
+         * The cache is remade whenever the size or
+           modification time of any of the AHF files
+           it came from changes
+         * halo_plist and halo_sublist point straight into
+           the map, which is copy-on-write since
+           remove_duplicates changes the plists
+************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <mpi.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+    load_halo_cache
+***********************/
+int load_halo_cache(void)
+{
+   // Fills H and nhalos_local from this task's halo cache. Returns 0, without
+   // touching H, if there's no cache or it doesn't match the AHF files.
+
+   int i;
+   int fd;
+   long expected;
+   long *hid;
+   long *host_id;
+   long *pstart;
+   long *sstart;
+   long *sublist;
+   float *m_vir;
+   int *npart;
+   int *nsub;
+   int *plist;
+   char *fname;
+   char *map;
+   struct stat st;
+   HALO_CACHE_HEADER current;
+   HALO_CACHE_HEADER *head;
+
+   fname = get_halo_cache_fname();
+
+   if((fd = open(fname, O_RDONLY)) < 0)
+   {
+      free(fname);
+      return 0;
+   }
+
+   if((fstat(fd, &st) != 0) || (st.st_size < (long)sizeof(HALO_CACHE_HEADER)))
+   {
+      close(fd);
+      free(fname);
+      return 0;
+   }
+
+   // The plists are changed in place later, so writes have to go to private
+   // copies of the pages and not to the file
+   if((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+   {
+      printf("Error, could not map halo cache %s!\n", fname);
+      exit(EXIT_FAILURE);
+   }
+
+   close(fd);
+
+   head = (HALO_CACHE_HEADER *)map;
+
+   get_halo_cache_sources(&current);
+
+   if((head->magic != HALO_CACHE_MAGIC) || (head->version != HALO_CACHE_VERSION) ||
+      (memcmp(head->src_size, current.src_size, sizeof(current.src_size)) != 0) ||
+      (memcmp(head->src_mtime, current.src_mtime, sizeof(current.src_mtime)) != 0))
+   {
+      printf("Halo cache %s is out of date, re-reading the AHF files\n", fname);
+      munmap(map, st.st_size);
+      free(fname);
+      return 0;
+   }
+
+   expected = get_halo_cache_length(head);
+
+   if(st.st_size != expected)
+   {
+      printf("Halo cache %s is %ld bytes instead of %ld, re-reading the AHF files\n", fname,
+             (long)st.st_size, expected);
+      munmap(map, st.st_size);
+      free(fname);
+      return 0;
+   }
+
+   // Find the arrays. See write_halo_cache for the layout
+   nhalos_local = head->nhalos;
+
+   hid = (long *)(map + sizeof(HALO_CACHE_HEADER));
+   host_id = hid + nhalos_local;
+   pstart = host_id + nhalos_local;
+   sstart = pstart + nhalos_local;
+   sublist = sstart + nhalos_local;
+   m_vir = (float *)(sublist + head->nsub_tot);
+   npart = (int *)(m_vir + nhalos_local);
+   nsub = npart + nhalos_local;
+   plist = nsub + nhalos_local;
+
+   if(!(H = calloc(nhalos_local, sizeof(HALO_DATA))))
+   {
+      printf("Error, could not allocate memory for halos!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      H[i].hid = hid[i];
+      H[i].host_id = host_id[i];
+      H[i].m_vir = m_vir[i];
+      H[i].npart = npart[i];
+      H[i].pstart = pstart[i];
+      H[i].nsub = nsub[i];
+      H[i].sstart = sstart[i];
+      H[i].new_id = 0;
+   }
+
+   // The lists are used straight out of the map
+   halo_plist = plist;
+   halo_plist_len = head->npart_tot;
+   halo_sublist = sublist;
+   halo_sublist_len = head->nsub_tot;
+
+   halo_cache_map = map;
+   halo_cache_length = st.st_size;
+
+   build_halo_index(&halo_index, H, nhalos_local);
+
+   free(fname);
+
+   return 1;
+}
+
+
+
+/***********************
+    write_halo_cache
+***********************/
+void write_halo_cache(void)
+{
+   // Writes the first nhalos_local halos in H and the halo lists to this
+   // task's halo cache. The header is followed by, in order:
+   //    hid[nhalos], host_id[nhalos]              (long)
+   //    pstart[nhalos], sstart[nhalos]            (long)
+   //    halo_sublist[nsub_tot]                    (long)
+   //    m_vir[nhalos]                             (float)
+   //    npart[nhalos], nsub[nhalos]               (int)
+   //    halo_plist[npart_tot]                     (int)
+   // which keeps every array aligned.
+   // The cache is written to a temporary file that's then renamed, so a run
+   // that dies part way through never leaves a broken cache behind. Not
+   // being able to write the cache isn't an error; the next run just parses
+   // the AHF files again.
+
+   int i;
+   int ok = 1;
+   char *fname;
+   char tmpname[300];
+   FILE *fd;
+   HALO_CACHE_HEADER head;
+
+   fname = get_halo_cache_fname();
+
+   sprintf(tmpname, "%s.tmp", fname);
+
+   if(!(fd = fopen(tmpname, "wb")))
+   {
+      printf("Task %d could not write halo cache %s, continuing without it\n", thistask, fname);
+      free(fname);
+      return;
+   }
+
+   get_halo_cache_sources(&head);
+
+   head.magic = HALO_CACHE_MAGIC;
+   head.version = HALO_CACHE_VERSION;
+   head.nhalos = nhalos_local;
+   head.npart_tot = halo_plist_len;
+   head.nsub_tot = halo_sublist_len;
+
+   ok &= (fwrite(&head, sizeof(HALO_CACHE_HEADER), 1, fd) == 1);
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].hid, sizeof(long), 1, fd) == 1);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].host_id, sizeof(long), 1, fd) == 1);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].pstart, sizeof(long), 1, fd) == 1);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].sstart, sizeof(long), 1, fd) == 1);
+   }
+
+   ok &= (fwrite(halo_sublist, sizeof(long), halo_sublist_len, fd) == (size_t)halo_sublist_len);
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].m_vir, sizeof(float), 1, fd) == 1);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].npart, sizeof(int), 1, fd) == 1);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      ok &= (fwrite(&H[i].nsub, sizeof(int), 1, fd) == 1);
+   }
+
+   ok &= (fwrite(halo_plist, sizeof(int), halo_plist_len, fd) == (size_t)halo_plist_len);
+
+   // A short write leaves ok at 0, and the temporary file is dropped the same
+   // as if it couldn't be closed or renamed
+   ok &= (fclose(fd) == 0);
+
+   if(!ok || (rename(tmpname, fname) != 0))
+   {
+      printf("Task %d could not write halo cache %s, continuing without it\n", thistask, fname);
+      remove(tmpname);
+   }
+
+   free(fname);
+}
+
+
+
+/***********************
+ get_halo_cache_sources
+***********************/
+void get_halo_cache_sources(HALO_CACHE_HEADER *head)
+{
+   // Fills in the sizes and modification times of this task's AHF files
+
+   int i;
+   char *fname;
+   char *ftypes[3] = {"p", "s", "h"};
+   struct stat st;
+
+   for(i = 0; i < 3; i++)
+   {
+      fname = get_halo_fname(ftypes[i]);
+
+      if(stat(fname, &st) != 0)
+      {
+         printf("Error, could not stat AHF file %s!\n", fname);
+         exit(EXIT_FAILURE);
+      }
+
+      head->src_size[i] = st.st_size;
+      head->src_mtime[i] = st.st_mtime;
+
+      free(fname);
+   }
+}
+
+
+
+/***********************
+ get_halo_cache_length
+***********************/
+long get_halo_cache_length(HALO_CACHE_HEADER *head)
+{
+   // Number of bytes a cache with head should be (see write_halo_cache)
+
+   long n = head->nhalos;
+
+   return sizeof(HALO_CACHE_HEADER) + (4 * n + head->nsub_tot) * sizeof(long) + n * sizeof(float) +
+          (2 * n + head->npart_tot) * sizeof(int);
+}
+
+
+
+/***********************
+  get_halo_cache_fname
+***********************/
+char *get_halo_cache_fname(void)
+{
+   // The cache sits next to the AHF_particles file it was made from
+
+   char *fname;
+   char *buf;
+
+   fname = get_halo_fname("p");
+
+   if(!(buf = calloc(strlen(fname) + 16, sizeof(char))))
+   {
+      printf("Error, could not allocate memory for halo cache name!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   sprintf(buf, "%s.tspec_cache", fname);
+
+   free(fname);
+
+   return buf;
+}
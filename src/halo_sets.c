@@ -0,0 +1,378 @@
+/************************************************
+Title: halo_sets.c
+Purpose: Contains functions for sharing multiple AHF
+         file sets out between the tasks when there
+         aren't the same number of each
+Notes:   * With more sets than tasks, each task reads whole
+           sets, one after the other, into the same H. With
+           fewer, each set is split between a group of tasks
+           (see halo_split.c). Either way the sets are shared
+           out by the size of their particles files
+         * With the same number of each, task i reads set i,
+           as AHF wrote them
+         * Flagging doesn't care where a halo is, since
+           remove_duplicates looks on every task for the sub
+           halos that aren't on the host's. See
+           remove_duplicates_local for the one thing that
+           changes when a task has more than one set
+************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+    assign_halo_sets
+***********************/
+void assign_halo_sets(int nsets)
+{
+   // Fills in first_task and ntasks for each of the nsets sets in halo_sets,
+   // whose sizes are already set. With more sets than tasks, the biggest set
+   // left always goes to the task with the least to read so far. With fewer,
+   // every set starts with one task and each spare task goes to the set with
+   // the most to read per task.
+
+   int i;
+   int t;
+   int best;
+   int *order;
+   double *load;
+
+   if(!(order = calloc(nsets, sizeof(int))) || !(load = calloc(ntasks, sizeof(double))))
+   {
+      printf("Error, could not allocate memory for assigning AHF file sets!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < nsets; i++)
+   {
+      halo_sets[i].first_task = i;
+      halo_sets[i].ntasks = 1;
+      order[i] = i;
+   }
+
+   if(nsets > ntasks)
+   {
+      qsort(order, nsets, sizeof(int), halo_set_cmp);
+
+      for(i = 0; i < nsets; i++)
+      {
+         for(t = 1, best = 0; t < ntasks; t++)
+         {
+            if(load[t] < load[best])
+            {
+               best = t;
+            }
+         }
+
+         halo_sets[order[i]].first_task = best;
+         load[best] += halo_sets[order[i]].size;
+      }
+   }
+
+   else if(nsets < ntasks)
+   {
+      for(t = nsets; t < ntasks; t++)
+      {
+         for(i = 1, best = 0; i < nsets; i++)
+         {
+            if((double)halo_sets[i].size / halo_sets[i].ntasks >
+               (double)halo_sets[best].size / halo_sets[best].ntasks)
+            {
+               best = i;
+            }
+         }
+
+         halo_sets[best].ntasks++;
+      }
+
+      for(i = 1; i < nsets; i++)
+      {
+         halo_sets[i].first_task = halo_sets[i - 1].first_task + halo_sets[i - 1].ntasks;
+      }
+   }
+
+   free(order);
+   free(load);
+}
+
+
+
+/***********************
+      halo_set_cmp
+***********************/
+int halo_set_cmp(const void *p1, const void *p2)
+{
+   // Used with qsort in assign_halo_sets. Orders set indices from the biggest
+   // particles file to the smallest, and by index for the same size
+
+   int set1 = *(const int *)p1;
+   int set2 = *(const int *)p2;
+
+   if(halo_sets[set1].size != halo_sets[set2].size)
+   {
+      return (halo_sets[set1].size > halo_sets[set2].size) ? -1 : 1;
+   }
+
+   return set1 - set2;
+}
+
+
+
+/***********************
+     reads_halo_set
+***********************/
+int reads_halo_set(int set)
+{
+   // Whether this task reads some or all of set
+
+   return (thistask >= halo_sets[set].first_task) &&
+          (thistask < halo_sets[set].first_task + halo_sets[set].ntasks);
+}
+
+
+
+/***********************
+    select_halo_set
+***********************/
+void select_halo_set(int set)
+{
+   // Makes set the one that get_halo_fname gives the files of
+
+   memcpy(ahf_fnames, halo_sets[set].fnames, sizeof(ahf_fnames));
+   ahf_set = set;
+}
+
+
+
+/***********************
+     set_halo_order
+***********************/
+void set_halo_order(long int first)
+{
+   // Sets where each of the nhalos_local halos in H, which start with halo
+   // number first of the set being read, comes when flagging. With multiple
+   // file sets the halos go a round at a time, halo i of each set in turn, so
+   // they come in the same order as when task i read set i, no matter how the
+   // sets are shared out. It doesn't matter with one set, but it's still the
+   // order they're in.
+
+   int i;
+   int nsets = 1;
+
+   if(n_halo_tasks > 1)
+   {
+      nsets = n_halo_tasks;
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      H[i].order = (first + i) * nsets + ahf_set;
+   }
+}
+
+
+
+/***********************
+    halo_order_cmp
+***********************/
+int halo_order_cmp(const void *p1, const void *p2)
+{
+   // Used with qsort in read_halo_sets. Orders halos by HALO_DATA.order
+
+   const HALO_DATA *elem1 = p1;
+   const HALO_DATA *elem2 = p2;
+
+   return (elem1->order > elem2->order) - (elem1->order < elem2->order);
+}
+
+
+
+/***********************
+     read_halo_sets
+***********************/
+void read_halo_sets(void)
+{
+   // Reads the AHF file sets, or the part of one, that this task has into
+   // the first nhalos_local entries of H. Several sets are read one after the
+   // other, and then H is sorted by order (see set_halo_order). Collective.
+
+   int i;
+   int set;
+   int nhalos = 0;
+   long int plen = 0;
+   long int slen = 0;
+   long int max_plist = 0;
+   long int max_sublist = 0;
+   int *plist = NULL;
+   long int *sublist = NULL;
+   HALO_DATA *halos = NULL;
+   MPI_Comm comm;
+
+   #ifdef PROFILING
+      double start_time;
+      double end_time;
+
+      start_time = MPI_Wtime();
+   #endif
+
+   // With fewer sets than tasks every task has exactly one set, which it
+   // might be sharing
+   if(n_halo_tasks < ntasks)
+   {
+      for(set = 0; set < n_halo_tasks - 1; set++)
+      {
+         if(reads_halo_set(set))
+         {
+            break;
+         }
+      }
+
+      MPI_Comm_split(MPI_COMM_WORLD, set, thistask, &comm);
+
+      select_halo_set(set);
+
+      if(halo_sets[set].ntasks > 1)
+      {
+         read_halo_set_part(comm);
+      }
+
+      else
+      {
+         read_halo_set();
+      }
+
+      MPI_Comm_free(&comm);
+   }
+
+   // H can be used as is when there's just one set
+   else if(halo_set_count == 1)
+   {
+      read_halo_set();
+   }
+
+   else
+   {
+      for(set = 0; set < n_halo_tasks; set++)
+      {
+         if(!reads_halo_set(set))
+         {
+            continue;
+         }
+
+         select_halo_set(set);
+         read_halo_set();
+
+         // Put the set on the end of what's been read so far
+         if(!(halos = realloc(halos, (nhalos + nhalos_local + 1) * sizeof(HALO_DATA))))
+         {
+            printf("Error, could not allocate memory for halos!\n");
+            exit(EXIT_FAILURE);
+         }
+
+         for(i = 0; i < nhalos_local; i++)
+         {
+            halos[nhalos + i] = H[i];
+            halos[nhalos + i].pstart += plen;
+            halos[nhalos + i].sstart += slen;
+         }
+
+         plist = grow_halo_list(plist, &max_plist, plen + halo_plist_len, sizeof(int));
+         memcpy(plist + plen, halo_plist, halo_plist_len * sizeof(int));
+
+         sublist = grow_halo_list(sublist, &max_sublist, slen + halo_sublist_len,
+                                  sizeof(long int));
+         memcpy(sublist + slen, halo_sublist, halo_sublist_len * sizeof(long int));
+
+         nhalos += nhalos_local;
+         plen += halo_plist_len;
+         slen += halo_sublist_len;
+
+         free_halos();
+      }
+
+      H = halos;
+      nhalos_local = nhalos;
+      halo_plist = plist;
+      halo_plist_len = plen;
+      halo_sublist = sublist;
+      halo_sublist_len = slen;
+
+      qsort(H, nhalos_local, sizeof(HALO_DATA), halo_order_cmp);
+
+      build_halo_index(&halo_index, H, nhalos_local);
+   }
+
+   #ifdef PROFILING
+      end_time = MPI_Wtime();
+      MPI_Allreduce(MPI_IN_PLACE, &end_time, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+      if(thistask == 0)
+      {
+         printf("Read %d AHF file sets with %d tasks in %e secs\n", n_halo_tasks, ntasks,
+                end_time - start_time);
+      }
+   #endif
+}
+
+
+
+/***********************
+   read_halo_set_part
+***********************/
+void read_halo_set_part(MPI_Comm comm)
+{
+   // Reads this task's part of the set being read, which is split between the
+   // tasks in comm. If the particles file can't be split, the first task in
+   // comm reads the whole set and the rest get no halos. The halo cache is
+   // only used in that case, since it's for a whole set. Collective on comm.
+
+   int rank;
+   long int n;
+   long int first = 0;
+
+   MPI_Comm_rank(comm, &rank);
+
+   if(read_halo_particles_part(comm))
+   {
+      // Where this task's halos start in the set
+      n = nhalos_local;
+      MPI_Exscan(&n, &first, 1, MPI_LONG, MPI_SUM, comm);
+
+      if(rank == 0)
+      {
+         first = 0;
+      }
+
+      build_halo_index(&halo_index, H, nhalos_local);
+
+      read_halo_substruct(1);
+      read_virial_mass(first);
+      set_halo_order(first);
+   }
+
+   else if(rank == 0)
+   {
+      read_halo_set();
+   }
+
+   else
+   {
+      nhalos_local = 0;
+
+      if(!(H = calloc(1, sizeof(HALO_DATA))))
+      {
+         printf("Error, could not allocate memory for halos!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      halo_plist = NULL;
+      halo_plist_len = 0;
+
+      build_halo_index(&halo_index, H, nhalos_local);
+   }
+}
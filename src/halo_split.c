@@ -0,0 +1,489 @@
+/************************************************
+Title: halo_split.c
+Purpose: Contains functions for reading one AHF
+         file set with several tasks instead of just
+         one
+Notes:   * Only the particles file is split up, since it's
+           nearly all of the file set
+         * With a single file set the halos end up on root,
+           same as when root reads them itself, so nothing
+           after loading has to change. With multiple file
+           sets each task keeps its part (see halo_sets.c)
+         * Each task parses the halos whose first line
+           starts in its byte range of the file. A halo's
+           first line is told apart from its particle lines
+           by its second column (see AHF_MAX_PTYPE). That
+           can't be guaranteed, so the pieces are checked
+           against each other afterwards, and if they don't
+           fit together root reads the file itself
+************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <mpi.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+read_halo_particles_split
+***********************/
+int read_halo_particles_split(void)
+{
+   // Reads the AHF_particles file of the one AHF file set with every task.
+   // Returns 1 if root now has H (nhalos_local, hid, npart and pstart) and
+   // halo_plist the same as read_halo_particles would have left them, and 0
+   // if root has to read the file itself. Collective.
+
+   int i;
+   long int j;
+   long int total;
+   long int *hids;
+   long int *all_hids = NULL;
+   int *npart;
+   int *all_npart = NULL;
+   int *all_plist = NULL;
+
+   if(!read_halo_particles_part(MPI_COMM_WORLD))
+   {
+      return 0;
+   }
+
+   // Put everything together on root
+   if(!(hids = malloc((nhalos_local + 1) * sizeof(long int))) ||
+      !(npart = malloc((nhalos_local + 1) * sizeof(int))))
+   {
+      printf("Error, could not allocate memory for split halos!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < nhalos_local; i++)
+   {
+      hids[i] = H[i].hid;
+      npart[i] = H[i].npart;
+   }
+
+   total = gather_on_root(hids, nhalos_local, MPI_LONG, sizeof(long int), (void **)&all_hids);
+   gather_on_root(npart, nhalos_local, MPI_INT, sizeof(int), (void **)&all_npart);
+   gather_on_root(halo_plist, halo_plist_len, MPI_INT, sizeof(int), (void **)&all_plist);
+
+   free(hids);
+   free(npart);
+   free(H);
+   free(halo_plist);
+
+   H = NULL;
+   halo_plist = NULL;
+   halo_plist_len = 0;
+   nhalos_local = 0;
+
+   if(thistask == 0)
+   {
+      nhalos_local = total;
+
+      if(!(H = calloc(nhalos_local, sizeof(HALO_DATA))))
+      {
+         printf("Error, could not allocate memory for halos!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      for(i = 0, j = 0; i < nhalos_local; i++)
+      {
+         H[i].hid = all_hids[i];
+         H[i].npart = all_npart[i];
+         H[i].pstart = j;
+         j += H[i].npart;
+      }
+
+      halo_plist = all_plist;
+      halo_plist_len = j;
+
+      build_halo_index(&halo_index, H, nhalos_local);
+
+      free(all_hids);
+      free(all_npart);
+   }
+
+   return 1;
+}
+
+
+
+/***********************
+read_halo_particles_part
+***********************/
+int read_halo_particles_part(MPI_Comm comm)
+{
+   // Reads the AHF_particles file of the set being read with every task in
+   // comm. Each task ends up with the halos that start in its part of the file
+   // in H and halo_plist, in the order they're in the file. H isn't indexed.
+   // Returns 0 on every task, with nothing allocated, if the parts don't fit
+   // together. Collective on comm.
+
+   int i;
+   int t;
+   int rank;
+   int size;
+   int ok = 1;
+   int nmine = 0;
+   int bad = 0;
+   int have_halo = 0;
+   long j;
+   long n = 0;
+   long hid = 0;
+   long begin;
+   long end;
+   long start = -1;
+   long stop = -1;
+   long cur;
+   long total = 0;
+   long nplist = 0;
+   long max_plist = 0;
+   long max_halos = 0;
+   long info[3];
+   long piece[5];
+   long *pieces;
+   long *hids = NULL;
+   int *npart = NULL;
+   int *plist = NULL;
+   char *fname;
+   FILE *fd;
+   AHF_READER r;
+   struct stat st;
+
+   MPI_Comm_rank(comm, &rank);
+   MPI_Comm_size(comm, &size);
+
+   fname = get_halo_fname("p");
+
+   // The first task finds out how many halos there are, where the first one
+   // starts and how big the file is
+   if(rank == 0)
+   {
+      if(!(fd = fopen(fname, "r")) || (fstat(fileno(fd), &st) != 0))
+      {
+         printf("Error, could not open file for reading number of halos!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      open_ahf_reader(&r, fd);
+
+      info[0] = read_ahf_long(&r);
+      skip_ahf_space(&r);
+      info[1] = r.offset + r.pos;
+      info[2] = st.st_size;
+
+      close_ahf_reader(&r);
+   }
+
+   MPI_Bcast(info, 3, MPI_LONG, 0, comm);
+
+   if(info[0] == 0)
+   {
+      free(fname);
+      return 0;
+   }
+
+   // This task's share of the file
+   begin = info[1] + rank * (info[2] - info[1]) / size;
+   end = info[1] + (rank + 1) * (info[2] - info[1]) / size;
+
+   if(!(fd = fopen(fname, "r")))
+   {
+      printf("Error, task %d could not open %s for reading halos!\n", thistask, fname);
+      exit(EXIT_FAILURE);
+   }
+
+   // Find the first halo that starts in the share. The first share starts
+   // with one
+   if(rank == 0)
+   {
+      fseek(fd, begin, SEEK_SET);
+      open_ahf_reader(&r, fd);
+
+      start = begin;
+      n = read_ahf_long(&r);
+      hid = read_ahf_long(&r);
+      have_halo = 1;
+   }
+
+   else
+   {
+      // Start from the beginning of the first whole line in the share
+      fseek(fd, begin - 1, SEEK_SET);
+      open_ahf_reader(&r, fd);
+      skip_ahf_line(&r);
+
+      while(skip_ahf_space(&r) && (r.offset + (long)r.pos < end))
+      {
+         start = r.offset + r.pos;
+         n = read_ahf_long(&r);
+
+         if(!skip_ahf_space(&r))
+         {
+            break;
+         }
+
+         hid = read_ahf_long(&r);
+
+         if(hid > AHF_MAX_PTYPE)
+         {
+            have_halo = 1;
+            break;
+         }
+
+         skip_ahf_line(&r);
+      }
+   }
+
+   // Read halos until the next one starts past the share. The last one can
+   // run past the end of the share
+   while(have_halo)
+   {
+      if((n < 0) || (n > info[2]))
+      {
+         bad = 1;
+         break;
+      }
+
+      if(nmine == max_halos)
+      {
+         max_halos = (max_halos > 0) ? 2 * max_halos : 1024;
+
+         if(!(hids = realloc(hids, max_halos * sizeof(long))) ||
+            !(npart = realloc(npart, max_halos * sizeof(int))))
+         {
+            printf("Error, could not allocate memory for split halos!\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+
+      hids[nmine] = hid;
+      npart[nmine] = n;
+
+      plist = grow_halo_list(plist, &max_plist, nplist + n, sizeof(int));
+
+      // A particle line with a halo id means this wasn't really a halo's
+      // first line
+      for(j = 0; j < n; j++)
+      {
+         if(!skip_ahf_space(&r))
+         {
+            bad = 1;
+            break;
+         }
+
+         plist[nplist + j] = read_ahf_long(&r);
+
+         if(!skip_ahf_space(&r) || (read_ahf_long(&r) > AHF_MAX_PTYPE))
+         {
+            bad = 1;
+            break;
+         }
+      }
+
+      if(bad)
+      {
+         break;
+      }
+
+      sort_plist(plist + nplist, n);
+
+      nplist += n;
+      nmine++;
+
+      // Where the next halo starts (or the end of the file)
+      skip_ahf_space(&r);
+      stop = r.offset + r.pos;
+
+      if((stop >= end) || (stop >= info[2]))
+      {
+         break;
+      }
+
+      n = read_ahf_long(&r);
+
+      if(!skip_ahf_space(&r))
+      {
+         bad = 1;
+         break;
+      }
+
+      hid = read_ahf_long(&r);
+   }
+
+   close_ahf_reader(&r);
+
+   // Check that the pieces fit together: each task's first halo has to start
+   // where the halos before it stopped, and a task without any halos has to
+   // be inside a halo that started before it
+   piece[0] = have_halo;
+   piece[1] = start;
+   piece[2] = stop;
+   piece[3] = bad;
+   piece[4] = nmine;
+
+   if(!(pieces = malloc(5 * size * sizeof(long))))
+   {
+      printf("Error, could not allocate memory for split pieces!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   MPI_Allgather(piece, 5, MPI_LONG, pieces, 5, MPI_LONG, comm);
+
+   cur = info[1];
+
+   for(t = 0; t < size; t++)
+   {
+      if(pieces[5 * t + 3])
+      {
+         ok = 0;
+      }
+
+      else if(pieces[5 * t])
+      {
+         if(pieces[5 * t + 1] != cur)
+         {
+            ok = 0;
+         }
+
+         cur = pieces[5 * t + 2];
+      }
+
+      else if(cur < info[1] + (t + 1) * (info[2] - info[1]) / size)
+      {
+         ok = 0;
+      }
+
+      total += pieces[5 * t + 4];
+   }
+
+   if((cur < info[2]) || (total != info[0]))
+   {
+      ok = 0;
+   }
+
+   free(pieces);
+
+   if(!ok)
+   {
+      if(rank == 0)
+      {
+         printf("Could not split %s between the tasks, task %d is reading it instead\n", fname,
+                thistask);
+      }
+
+      free(hids);
+      free(npart);
+      free(plist);
+      free(fname);
+
+      return 0;
+   }
+
+   nhalos_local = nmine;
+
+   if(!(H = calloc(nhalos_local + 1, sizeof(HALO_DATA))))
+   {
+      printf("Error, could not allocate memory for halos!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0, j = 0; i < nhalos_local; i++)
+   {
+      H[i].hid = hids[i];
+      H[i].npart = npart[i];
+      H[i].pstart = j;
+      j += H[i].npart;
+   }
+
+   halo_plist = plist;
+   halo_plist_len = nplist;
+
+   free(hids);
+   free(npart);
+   free(fname);
+
+   return 1;
+}
+
+
+
+/***********************
+     gather_on_root
+***********************/
+long gather_on_root(void *sendbuf, long n, MPI_Datatype type, size_t size, void **recvbuf)
+{
+   // Puts every task's n elements of sendbuf one after the other, in task
+   // order, in *recvbuf on root, which is allocated here with room for one
+   // more. Returns the total on root. Unlike MPI_Gatherv, the counts can be
+   // more than an int, since it's done GATHER_CHUNK elements at a time.
+   // Collective.
+
+   int t;
+   int chunk;
+   long k;
+   long offset;
+   long total = 0;
+   long *counts = NULL;
+   char *buf;
+
+   if(thistask == 0)
+   {
+      if(!(counts = calloc(ntasks, sizeof(long))))
+      {
+         printf("Error, could not allocate memory for gather counts!\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   MPI_Gather(&n, 1, MPI_LONG, counts, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+
+   if(thistask == 0)
+   {
+      for(t = 0; t < ntasks; t++)
+      {
+         total += counts[t];
+      }
+
+      if(!(buf = malloc((total + 1) * size)))
+      {
+         printf("Error, could not allocate memory for gather buffer!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      memcpy(buf, sendbuf, n * size);
+      offset = n;
+
+      for(t = 1; t < ntasks; t++)
+      {
+         for(k = 0; k < counts[t]; k += chunk)
+         {
+            chunk = (counts[t] - k < GATHER_CHUNK) ? counts[t] - k : GATHER_CHUNK;
+
+            MPI_Recv(buf + (offset + k) * size, chunk, type, t, 0, MPI_COMM_WORLD,
+                     MPI_STATUS_IGNORE);
+         }
+
+         offset += counts[t];
+      }
+
+      *recvbuf = buf;
+   }
+
+   else
+   {
+      for(k = 0; k < n; k += chunk)
+      {
+         chunk = (n - k < GATHER_CHUNK) ? n - k : GATHER_CHUNK;
+
+         MPI_Send((char *)sendbuf + k * size, chunk, type, 0, 0, MPI_COMM_WORLD);
+      }
+   }
+
+   free(counts);
+
+   return total;
+}
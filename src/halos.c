@@ -9,6 +9,9 @@ Notes:   * This file SHOULD be all set to go in
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <mpi.h>
 #include "allvars.h"
 #include "proto.h"
@@ -22,32 +25,125 @@ void load_halos(void)
 {
    // Driver function for reading in halos
 
+   // Get the names of the AHF files and work out who reads which
+   find_halo_fnames();
+
+   #ifdef BENCH_AHF
+      benchmark_ahf_parser();
+   #endif
+
+   #ifdef BENCH_PLIST_SORT
+      benchmark_plist_sort();
+   #endif
+
+   #ifdef BENCH_HALO_INDEX
+      if(thistask == 0)
+      {
+         benchmark_halo_index(BENCH_HALO_INDEX);
+      }
+   #endif
+
    // Read in halo properties for multiple AHF file sets
    if(n_halo_tasks > 1)
    {
-      read_halo_particles();
+      read_halo_sets();
 
       // Get total number of halos across all file sets
       MPI_Reduce(&nhalos_local, &nhalos_tot, 1, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);  
-
-      // Read in substructure info
-      read_halo_substruct();
-
-      // Get M_vir for each halo
-      read_virial_mass();
    }
 
    // Read in halo properties for a single AHF file set. It's the same thing as above,
-   // but now only root reads the AHF files
+   // but now the halos all end up on root
    else
    {
-      if(thistask == 0)
+      read_halo_set();
+
+      #ifdef BENCH_REMOVE_DUPLICATES
+         if(thistask == 0)
+         {
+            benchmark_remove_duplicates();
+         }
+      #endif
+
+      nhalos_tot = nhalos_local;
+   }
+}
+
+
+
+/***********************
+     read_halo_set
+***********************/
+void read_halo_set(void)
+{
+   // Reads the AHF file set being read (see select_halo_set) into the first
+   // nhalos_local entries of H, from the halo cache if there's an up to date
+   // one. With a single file set this is collective: every task helps read the
+   // particles file (see halo_split.c), but only root keeps the halos
+
+   int from_cache = 0;
+   int split = 0;
+   int is_reader;
+
+   #ifdef PROFILING
+      double start_time;
+      double end_time;
+
+      start_time = MPI_Wtime();
+   #endif
+
+   is_reader = (n_halo_tasks > 1) || (thistask == 0);
+
+   #ifdef HALO_CACHE
+      if(is_reader)
       {
-         read_halo_particles();
-         read_halo_substruct();
-         read_virial_mass();
+         from_cache = load_halo_cache();
+      }
+
+      if(n_halo_tasks == 1)
+      {
+         MPI_Bcast(&from_cache, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      }
+   #endif
+
+   if(!from_cache)
+   {
+      if((n_halo_tasks == 1) && (ntasks > 1))
+      {
+         split = read_halo_particles_split();
+      }
+
+      if(is_reader)
+      {
+         if(!split)
+         {
+            read_halo_particles();
+         }
+
+         // Read in substructure info
+         read_halo_substruct(0);
+
+         // Get M_vir for each halo
+         read_virial_mass(0);
+
+         #ifdef HALO_CACHE
+            write_halo_cache();
+         #endif
       }
    }
+
+   set_halo_order(0);
+
+   #ifdef PROFILING
+      end_time = MPI_Wtime();
+
+      if(thistask == 0)
+      {
+         printf("Read %d halos from the %s in %e secs%s\n", nhalos_local,
+                from_cache ? "halo cache" : "AHF files", end_time - start_time,
+                split ? " (split between the tasks)" : "");
+      }
+   #endif
 }
 
 
@@ -64,9 +160,10 @@ void read_halo_particles(void)
 
    int i;
    int j;
-   int type;
+   long int max_plist = 0;
    char *fname;
    FILE *fd = NULL;
+   AHF_READER r;
 
    // Get the particle file name from the prefix passed
    // in the parameter file
@@ -79,93 +176,62 @@ void read_halo_particles(void)
       exit(EXIT_FAILURE);
    }
 
-   // Get number of halos
-   fscanf(fd, " %d\n", &nhalos_local);
-
-   // Get the max number of halos held by a single processor. This is to make communicating
-   // between processors easier because every processor will always have something to send.
-   // Only do this if we're working with multiple AHF file sets
-   if(n_halo_tasks != 1)
-   {
-      MPI_Allreduce(&nhalos_local, &nhalos_max, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
-   }
+   open_ahf_reader(&r, fd);
 
-   // When working with only one set, the max will be the local value
-   else
-   {
-      nhalos_max = nhalos_local;
-   }
+   // Get number of halos
+   nhalos_local = read_ahf_long(&r);
 
    // Allocate memory for halos struct
-   if(!(H = calloc(nhalos_max, sizeof(HALO_DATA))))
+   if(!(H = calloc(nhalos_local, sizeof(HALO_DATA))))
    {
       printf("Error, could not allocate memory for halos!\n");
       exit(EXIT_FAILURE);
    }
 
    // Initialize halos struct
-   for(i = 0; i < nhalos_max; i++)
+   for(i = 0; i < nhalos_local; i++)
    {
       H[i].npart = 0;
       H[i].hid = 0;
-      H[i].plist = NULL;
+      H[i].pstart = 0;
       H[i].nsub = 0;
-      H[i].sublist = NULL;
+      H[i].sstart = 0;
       H[i].m_vir = 0.0;
       H[i].host_id = 0;
       H[i].new_id = 0;
    }
 
-   // Read in halo info. We loop over nhalos_max instead of nhalos_local b/c
-   // it is much easier to do the communication to root if every task has
-   // the same number of halos. See flag.c. If we're outside the range of
-   // nhalos_local, I make a 'ghost halo' (ghostlo). This ghostlo has 1
-   // particle with id -1 and m_vir = -1 to distinuish it as as ghostlo
-   // intead of as a halo. These ghostlos are also padded at the end of H,
-   // which means they should not interfere with reading the substruct and
-   // viral mass from the other halo files.
-   for(i = 0; i < nhalos_max; i++)
+   // Read in halo info. Each plist goes on the end of halo_plist
+   halo_plist_len = 0;
+
+   for(i = 0; i < nhalos_local; i++)
    {
-      if(i < nhalos_local)
+      // Get number of particles and halo id
+      H[i].npart = read_ahf_long(&r);
+      H[i].hid = read_ahf_long(&r);
+      H[i].pstart = halo_plist_len;
+
+      halo_plist = grow_halo_list(halo_plist, &max_plist, halo_plist_len + H[i].npart,
+                                  sizeof(int));
+
+      // Read in halo particles. The type isn't needed
+      for(j = 0; j < H[i].npart; j++)
       {
-          // Get number of particles and halo id
-          fscanf(fd, "%d %ld\n", &H[i].npart, &H[i].hid);
-
-          // Allocate memory for particle list
-          if(!(H[i].plist = calloc(H[i].npart, sizeof(int))))
-          {
-             printf("Error, could not allocate memory for plist!\n");
-             exit(EXIT_FAILURE);
-          }
-
-          // Read in halo particles
-          for(j = 0; j < H[i].npart; j++)
-          {
-             fscanf(fd, "%d %d\n", &H[i].plist[j], &type);
-          }
-
-          // Sort the particle list
-          qsort(H[i].plist, H[i].npart, sizeof(int), cmpfunc);
+         PLIST(i)[j] = read_ahf_long(&r);
+         read_ahf_long(&r);
       }
 
-      else
-      {
-         if(!(H[i].plist = calloc(1, sizeof(int))))
-         {
-            printf("Error, could not allocate memory for ghostlo!\n");
-            exit(EXIT_FAILURE);
-         }
+      // Sort the particle list
+      sort_plist(PLIST(i), H[i].npart);
 
-         H[i].plist[0] = -1;
-         H[i].npart = 1;
-         H[i].m_vir = -1;
-         H[i].hid = -1;
-         H[i].nsub = 0;
-      }
+      halo_plist_len += H[i].npart;
    }
 
+   // Index H by hid for read_halo_substruct and remove_duplicates
+   build_halo_index(&halo_index, H, nhalos_local);
+
    // Close particles file
-   fclose(fd);
+   close_ahf_reader(&r);
 
    // Clean
    free(fname);
@@ -173,21 +239,217 @@ void read_halo_particles(void)
 
 
 
+/***********************
+       free_halos
+***********************/
+void free_halos(void)
+{
+   // Frees H and the halo lists, which are in the mapped cache if H came
+   // from the halo cache
+
+   // If there's only one AHF file set then H is only allocated on root
+   if((n_halo_tasks == 1) && (thistask != 0))
+   {
+      return;
+   }
+
+   if(halo_cache_map != NULL)
+   {
+      munmap(halo_cache_map, halo_cache_length);
+      halo_cache_map = NULL;
+      halo_cache_length = 0;
+   }
+
+   else
+   {
+      free(halo_plist);
+      free(halo_sublist);
+   }
+
+   halo_plist = NULL;
+   halo_sublist = NULL;
+   halo_plist_len = 0;
+   halo_sublist_len = 0;
+
+   free_halo_index(&halo_index);
+
+   free(H);
+   H = NULL;
+}
+
+
+
+/***********************
+     grow_halo_list
+***********************/
+void *grow_halo_list(void *list, long int *max, long int n, size_t size)
+{
+   // Makes sure that list, which has room for max entries of size bytes, has
+   // room for n. The room is doubled each time so that appending halo by halo
+   // doesn't realloc for every halo
+
+   if(n <= *max)
+   {
+      return list;
+   }
+
+   if(*max < 1024)
+   {
+      *max = 1024;
+   }
+
+   while(*max < n)
+   {
+      *max *= 2;
+   }
+
+   if(!(list = realloc(list, *max * size)))
+   {
+      printf("Error, could not allocate memory for halo list!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   return list;
+}
+
+
+
+/***********************
+    build_halo_index
+***********************/
+void build_halo_index(HALO_INDEX *idx, HALO_DATA *halos, int n)
+{
+   // Builds idx for the first n halos in halos, so that find_halo doesn't
+   // have to search them. The table is kept at most half full. If two halos
+   // have the same id, the first one is the one that's found, which is what
+   // searching from the start used to give
+
+   int i;
+   long int slot;
+
+   free_halo_index(idx);
+
+   idx->size = 1024;
+
+   while(idx->size < 2L * n)
+   {
+      idx->size *= 2;
+   }
+
+   if(!(idx->hid = malloc(idx->size * sizeof(long int))) ||
+      !(idx->index = malloc(idx->size * sizeof(int))))
+   {
+      printf("Error, could not allocate memory for halo index!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   memset(idx->index, -1, idx->size * sizeof(int));
+
+   for(i = 0; i < n; i++)
+   {
+      // Linear probing
+      slot = hash_hid(halos[i].hid) & (idx->size - 1);
+
+      while((idx->index[slot] != -1) && (idx->hid[slot] != halos[i].hid))
+      {
+         slot = (slot + 1) & (idx->size - 1);
+      }
+
+      if(idx->index[slot] == -1)
+      {
+         idx->hid[slot] = halos[i].hid;
+         idx->index[slot] = i;
+      }
+   }
+}
+
+
+
+/***********************
+       find_halo
+***********************/
+int find_halo(HALO_INDEX *idx, long int hid)
+{
+   // Returns the index of the halo with id hid, or -1 if it isn't in idx.
+   // Use halo_index to look in H
+
+   long int slot;
+
+   if(idx->size == 0)
+   {
+      return -1;
+   }
+
+   slot = hash_hid(hid) & (idx->size - 1);
+
+   while(idx->index[slot] != -1)
+   {
+      if(idx->hid[slot] == hid)
+      {
+         return idx->index[slot];
+      }
+
+      slot = (slot + 1) & (idx->size - 1);
+   }
+
+   return -1;
+}
+
+
+
+/***********************
+        hash_hid
+***********************/
+unsigned long hash_hid(long int hid)
+{
+   // AHF's ids share most of their bits with their neighbours, so they're
+   // mixed (the splitmix64 finalizer) before being used as a slot
+
+   unsigned long h = (unsigned long)hid;
+
+   h ^= h >> 30;
+   h *= 0xbf58476d1ce4e5b9UL;
+   h ^= h >> 27;
+   h *= 0x94d049bb133111ebUL;
+   h ^= h >> 31;
+
+   return h;
+}
+
+
+
+/***********************
+    free_halo_index
+***********************/
+void free_halo_index(HALO_INDEX *idx)
+{
+   free(idx->hid);
+   free(idx->index);
+
+   idx->size = 0;
+   idx->hid = NULL;
+   idx->index = NULL;
+}
+
+
+
 /***********************
   read_halo_substruct
 ***********************/
-void read_halo_substruct(void)
+void read_halo_substruct(int part)
 {
-   // Gets list of subhalos and nsub_halos
+   // Gets list of subhalos and nsub_halos. If part is set, H only has some of
+   // the set's halos (see read_halo_set_part), and the hosts that aren't in H
+   // are skipped
 
    FILE *fd;
-   int i;
    int j;
    int k;
    int nsub;
    long int hid;
-   int nlines = 0;
+   long int max_sublist = 0;
    char *fname;
+   AHF_READER r;
 
    // Get file name
    fname = get_halo_fname("s");
@@ -199,16 +461,7 @@ void read_halo_substruct(void)
       exit(EXIT_FAILURE);
    } 
 
-   // Get the number of lines in the file
-   while((i = getc(fd)) != EOF)
-   {
-      if(i == '\n')
-      {
-         nlines++;
-      }
-   }
-
-   // There has to be an even number of lines in the file b/c it writes
+   // AHF writes
    // hid nsub_halos\n sub1 sub2 ...subN\n (that is, there are two lines
    // for every halo: the halo id with nsub_halos, and then the list of
    // subhalos. Only those halos that have sub structure are written)
@@ -225,56 +478,52 @@ void read_halo_substruct(void)
 
    // Because all this does is read the sublist from the subhalos file, this function
    // will work in parallel
-   nlines = nlines / 2;
+   open_ahf_reader(&r, fd);
 
-   // Go back to beginning
-   rewind(fd);
+   // Each sublist goes on the end of halo_sublist
+   halo_sublist_len = 0;
 
-   // Loop over sub structure file
-   for(i = 0; i < nlines; i++)
+   // Loop over sub structure file until there's nothing left in it. The file
+   // is only read once, so halo_sublist grows as it goes
+   while(skip_ahf_space(&r))
    {
-      j = 0;
-
       // Line up current halo with entry in H
-      fscanf(fd, "%ld %d\n", &hid, &nsub);
+      hid = read_ahf_long(&r);
+      nsub = read_ahf_long(&r);
 
-      while(H[j].hid != hid)
+      if((j = find_halo(&halo_index, hid)) < 0)
       {
-         j++;
-
-         if(j >= nhalos_local)
+         if(part)
          {
-            printf("Error, could not find current halo in substruct in H!\n");
-            exit(EXIT_FAILURE);
+            for(k = 0; k < nsub; k++)
+            {
+               read_ahf_long(&r);
+            }
+
+            continue;
          }
+
+         printf("Error, could not find current halo in substruct in H!\n");
+         exit(EXIT_FAILURE);
       }
 
       H[j].nsub = nsub;
+      H[j].sstart = halo_sublist_len;
 
-      // Allocate memory for sublist
-      if(!(H[j].sublist = calloc(H[j].nsub, sizeof(long int))))
-      {
-         printf("Error, could not allocate memory for sublist!\n");
-         exit(EXIT_FAILURE);
-      }
+      halo_sublist = grow_halo_list(halo_sublist, &max_sublist, halo_sublist_len + H[j].nsub,
+                                    sizeof(long int));
 
       // Read in the sublist
       for(k = 0; k < H[j].nsub; k++)
       {
-         if(k != (H[j].nsub - 1))
-         {
-            fscanf(fd, "%ld ", &H[j].sublist[k]);
-         }
-
-         else
-         {
-            fscanf(fd, "%ld\n", &H[j].sublist[k]);
-         }
+         SUBLIST(j)[k] = read_ahf_long(&r);
       }
+
+      halo_sublist_len += H[j].nsub;
    }
 
    // Close file
-   fclose(fd);
+   close_ahf_reader(&r);
 
    // Clean
    free(fname);
@@ -285,17 +534,17 @@ void read_halo_substruct(void)
 /***********************
    read_virial_mass
 ***********************/
-void read_virial_mass(void)
+void read_virial_mass(long int first)
 {
    // Reads the virial mass for each halo from the
-   // halos file
+   // halos file. H starts with the set's halo number first
 
    FILE *fd;
    int i;
-   int j;
    int nsub;
    long int hid;
    char *fname;
+   AHF_READER r;
 
    // Get filename
    fname = get_halo_fname("h");
@@ -307,20 +556,28 @@ void read_virial_mass(void)
       exit(EXIT_FAILURE);
    }
 
+   open_ahf_reader(&r, fd);
+
    // Skip the header (only applicable on the root set of files)
-   if(thistask == 0)
+   if(ahf_set == 0)
+   {
+      skip_ahf_line(&r);
+   }
+
+   // Skip the halos before H's
+   for(i = 0; i < first; i++)
    {
-       while((i = getc(fd)) != '\n')
-       {
-          continue;
-       }
+      skip_ahf_line(&r);
    }
 
    // Loop over every halo
    for(i = 0; i < nhalos_local; i++)
    {
       // Read M_vir. It's the 4th column
-      fscanf(fd, "%ld %ld %d %f", &hid, &H[i].host_id, &nsub, &H[i].m_vir);
+      hid = read_ahf_long(&r);
+      H[i].host_id = read_ahf_long(&r);
+      nsub = read_ahf_long(&r);
+      H[i].m_vir = read_ahf_float(&r);
 
       // Error check. I might need to do this after each halo has been read in, as I'm
       // not sure about the ordering when ahf is run in parallel. That is, I might need
@@ -333,14 +590,11 @@ void read_virial_mass(void)
       }
 
       // Read the rest of the line
-      while((j = getc(fd)) != '\n')
-      {
-         continue;
-      }        
+      skip_ahf_line(&r);
    }
 
    // Close file
-   fclose(fd);
+   close_ahf_reader(&r);
 
    // Clean
    free(fname);
@@ -348,6 +602,237 @@ void read_virial_mass(void)
 
 
 
+/***********************
+    open_ahf_reader
+***********************/
+void open_ahf_reader(AHF_READER *r, FILE *fd)
+{
+   // Sets r up to read the AHF file open in fd from where fd is now.
+   // close_ahf_reader closes fd
+
+   r->fd = fd;
+   r->len = 0;
+   r->pos = 0;
+   r->eof = 0;
+   r->offset = ftell(fd);
+
+   if(!(r->buf = malloc(AHF_BUFSIZE + 1)))
+   {
+      printf("Error, could not allocate memory for AHF read buffer!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   r->buf[0] = '\0';
+
+   fill_ahf_reader(r);
+}
+
+
+
+/***********************
+    fill_ahf_reader
+***********************/
+void fill_ahf_reader(AHF_READER *r)
+{
+   // Moves whatever hasn't been read yet to the front of the buffer and fills
+   // the rest of it from the file
+
+   size_t nwant;
+   size_t nread;
+
+   if(r->eof)
+   {
+      return;
+   }
+
+   memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+   r->offset += r->pos;
+   r->len -= r->pos;
+   r->pos = 0;
+
+   nwant = AHF_BUFSIZE - r->len;
+   nread = fread(r->buf + r->len, 1, nwant, r->fd);
+   r->len += nread;
+
+   if(nread < nwant)
+   {
+      r->eof = 1;
+   }
+
+   r->buf[r->len] = '\0';
+}
+
+
+
+/***********************
+     skip_ahf_space
+***********************/
+int skip_ahf_space(AHF_READER *r)
+{
+   // Skips the whitespace in front of the next number and makes sure that
+   // all of it is in the buffer. Returns 0 if there's nothing left in the file
+
+   for(;;)
+   {
+      while((r->pos < r->len) && ((r->buf[r->pos] == ' ') || (r->buf[r->pos] == '\n') ||
+            (r->buf[r->pos] == '\t') || (r->buf[r->pos] == '\r')))
+      {
+         r->pos++;
+      }
+
+      if((r->pos < r->len) || r->eof)
+      {
+         break;
+      }
+
+      fill_ahf_reader(r);
+   }
+
+   if(r->len - r->pos < AHF_TOKEN_MAX)
+   {
+      fill_ahf_reader(r);
+   }
+
+   return r->pos < r->len;
+}
+
+
+
+/***********************
+     next_ahf_token
+***********************/
+char *next_ahf_token(AHF_READER *r)
+{
+   // Returns where the next number starts (see skip_ahf_space)
+
+   if(!skip_ahf_space(r))
+   {
+      printf("Error, unexpected end of AHF file!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   return r->buf + r->pos;
+}
+
+
+
+/***********************
+     read_ahf_long
+***********************/
+long int read_ahf_long(AHF_READER *r)
+{
+   // Parses the next integer in the file. This replaces fscanf, which was
+   // most of the time spent reading the halos
+
+   int neg = 0;
+   unsigned int digit;
+   long int val = 0;
+   char *c;
+   char *start;
+
+   c = next_ahf_token(r);
+
+   if((*c == '-') || (*c == '+'))
+   {
+      neg = (*c == '-');
+      c++;
+   }
+
+   start = c;
+
+   // The buffer is null-terminated, so this always stops
+   while((digit = (unsigned int)(*c - '0')) < 10)
+   {
+      val = 10 * val + digit;
+      c++;
+   }
+
+   if(c == start)
+   {
+      printf("Error, expected an integer in AHF file but got '%c'!\n", *c);
+      exit(EXIT_FAILURE);
+   }
+
+   r->pos = c - r->buf;
+
+   return neg ? -val : val;
+}
+
+
+
+/***********************
+     read_ahf_float
+***********************/
+float read_ahf_float(AHF_READER *r)
+{
+   // Parses the next float in the file. strtof gives the same answer that
+   // fscanf's %f did
+
+   float val;
+   char *c;
+   char *end;
+
+   c = next_ahf_token(r);
+
+   val = strtof(c, &end);
+
+   if(end == c)
+   {
+      printf("Error, expected a float in AHF file but got '%c'!\n", *c);
+      exit(EXIT_FAILURE);
+   }
+
+   r->pos = end - r->buf;
+
+   return val;
+}
+
+
+
+/***********************
+     skip_ahf_line
+***********************/
+void skip_ahf_line(AHF_READER *r)
+{
+   // Moves past the next newline
+
+   char *nl;
+
+   for(;;)
+   {
+      if((nl = memchr(r->buf + r->pos, '\n', r->len - r->pos)) != NULL)
+      {
+         r->pos = nl - r->buf + 1;
+         return;
+      }
+
+      r->pos = r->len;
+
+      if(r->eof)
+      {
+         return;
+      }
+
+      fill_ahf_reader(r);
+   }
+}
+
+
+
+/***********************
+    close_ahf_reader
+***********************/
+void close_ahf_reader(AHF_READER *r)
+{
+   fclose(r->fd);
+   free(r->buf);
+
+   r->fd = NULL;
+   r->buf = NULL;
+}
+
+
+
 /***********************
         cmpfunc
 ***********************/
@@ -364,100 +849,267 @@ int cmpfunc(const void *p1, const void *p2)
 
 
 /***********************
-    get_halo_fname
+       sort_plist
 ***********************/
-char *get_halo_fname(char *ftype)
+void sort_plist(int *plist, long int n)
 {
-   // This function gets the name of the file specified by ftype
-   // based on the prefix passed in the parameter file. This is
-   // needed because AHF appends strange numbers to each file that
-   // I don't know how to anticipate and can't find in the docs. 
-   // In order to have serial compatibility, we need to build the file
-   // names based on whether or not we're running with multiple processors.
-   // This always assumes that the number of ahf file sets is equal to the
-   // number of processors tspec is being run with, as I don't care to sort
-   // out the case of different numbers of filesets and processors.
-
-   char fname[100];
-   char command[200];
-   char f_to_open[200];
-   char *buf;
-   char *split_str;
-   FILE *fp = NULL;
+   // Sorts the n particle ids in plist into ascending order. AHF usually
+   // writes them in order already, so that's checked for first. Lists of up
+   // to PLIST_INSERTION_MAX ids get an insertion sort, and longer ones an LSD
+   // radix sort PLIST_RADIX_BITS at a time that skips the digits every id
+   // has in common. The ids are positive, so they're sorted as unsigned.
+
+   int bucket;
+   int shift;
+   int id;
+   long int i;
+   long int j;
+   long int count[PLIST_RADIX_BUCKETS + 1];
+   int *buf;
+   int *src;
+   int *dst;
+   int *tmp;
+
+   for(i = 1; i < n; i++)
+   {
+      if(plist[i] < plist[i - 1])
+      {
+         break;
+      }
+   }
 
-   if(!(buf = calloc(150, sizeof(char))))
+   if(i >= n)
    {
-      printf("Error, could not allocate memory for buf!\n");
-      exit(EXIT_FAILURE);   
+      return;
    }
 
-   // Build the fname with the wildcard character
-   if(strcmp(ftype, "p") == 0)
+   if(n <= PLIST_INSERTION_MAX)
    {
-      // Build parallel name. Make sure there's more than one AHF file set
-      if((ntasks > 1) && (n_halo_tasks != 1))
+      for(i = 1; i < n; i++)
       {
-         sprintf(fname, "%s.%04d*.AHF_particles", part_file, thistask);
-      }
+         id = plist[i];
 
-      // Serial name
-      else
-      {
-         sprintf(fname, "%s.*.AHF_particles", part_file);
+         for(j = i; (j > 0) && (plist[j - 1] > id); j--)
+         {
+            plist[j] = plist[j - 1];
+         }
 
+         plist[j] = id;
       }
+
+      return;
    }
 
-   else if(strcmp(ftype, "s") == 0)
+   if(!(buf = malloc(n * sizeof(int))))
    {
-      // Parallel name
-      if((ntasks > 1) && (n_halo_tasks != 1))
+      printf("Error, could not allocate memory for sorting plist!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   src = plist;
+   dst = buf;
+
+   for(shift = 0; shift < 32; shift += PLIST_RADIX_BITS)
+   {
+      memset(count, 0, (PLIST_RADIX_BUCKETS + 1) * sizeof(long int));
+
+      // Histogram the digits, offset by one so the prefix sum gives each
+      // bucket's starting position
+      for(i = 0; i < n; i++)
+      {
+         count[(((unsigned int)src[i] >> shift) & (PLIST_RADIX_BUCKETS - 1)) + 1]++;
+      }
+
+      if(count[(((unsigned int)src[0] >> shift) & (PLIST_RADIX_BUCKETS - 1)) + 1] == n)
+      {
+         continue;
+      }
+
+      for(bucket = 1; bucket <= PLIST_RADIX_BUCKETS; bucket++)
       {
-         sprintf(fname, "%s.%04d*.AHF_substructure", subfile, thistask);
+         count[bucket] += count[bucket - 1];
       }
 
-      // Serial name
-      else
+      for(i = 0; i < n; i++)
       {
-         sprintf(fname, "%s.*.AHF_substructure", subfile);
-      
+         dst[count[((unsigned int)src[i] >> shift) & (PLIST_RADIX_BUCKETS - 1)]++] = src[i];
       }
+
+      tmp = src;
+      src = dst;
+      dst = tmp;
    }
 
-   else if(strcmp(ftype, "h") == 0)
+   if(src != plist)
+   {
+      memcpy(plist, src, n * sizeof(int));
+   }
+
+   free(buf);
+}
+
+
+
+/***********************
+    find_halo_fnames
+***********************/
+void find_halo_fnames(void)
+{
+   // AHF appends strange numbers to each file that I don't know how to
+   // anticipate and can't find in the docs, so the file names have to be
+   // found by matching a wildcard against what's on disk. With multiple AHF
+   // file sets, set i is the one whose files start with <prefix>.<i as %04d>.
+   // The sets don't have to match up with the tasks: assign_halo_sets works
+   // out which tasks read which sets.
+   // Root globs each type of file once and hands everyone the table of sets,
+   // so the file system only sees three directory scans no matter how many
+   // tasks there are. A set whose file isn't there gets an empty name, and
+   // fails when it's opened. Collective.
+
+   int i;
+   int t;
+   size_t k;
+   int multi;
+   int nsets = 1;
+   size_t len;
+   char prefix[128];
+   char pattern[128];
+   char *prefixes[3];
+   char *suffixes[3] = {"AHF_particles", "AHF_substructure", "AHF_halos"};
+   glob_t g;
+   struct stat st;
+
+   #ifdef PROFILING
+      double start_time;
+      double end_time;
+
+      start_time = MPI_Wtime();
+   #endif
+
+   // Are there multiple AHF file sets?
+   multi = (n_halo_tasks > 1);
+
+   if(multi)
    {
-      // Parallel name
-      if((ntasks > 1) && (n_halo_tasks != 1))
+      nsets = n_halo_tasks;
+   }
+
+   prefixes[0] = part_file;
+   prefixes[1] = subfile;
+   prefixes[2] = halo_file;
+
+   if(!(halo_sets = calloc(nsets, sizeof(HALO_SET))))
+   {
+      printf("Error, could not allocate memory for AHF file sets!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(thistask == 0)
+   {
+      for(i = 0; i < 3; i++)
       {
-         sprintf(fname, "%s.%04d*.AHF_halos", halo_file, thistask);
+         sprintf(pattern, "%s.*.%s", prefixes[i], suffixes[i]);
+
+         if(glob(pattern, 0, NULL, &g) != 0)
+         {
+            g.gl_pathc = 0;
+         }
+
+         // Each set's file is the first one, in sorted order, that matches
+         // <prefix>.<set as %04d>*.<suffix>. With one file set it's just the
+         // first one
+         for(t = 0; t < nsets; t++)
+         {
+            sprintf(prefix, "%s.%04d", prefixes[i], t);
+            len = strlen(prefix);
+
+            for(k = 0; k < g.gl_pathc; k++)
+            {
+               if(!multi || (strncmp(g.gl_pathv[k], prefix, len) == 0))
+               {
+                  strncpy(halo_sets[t].fnames[i], g.gl_pathv[k], sizeof(ahf_fnames[0]) - 1);
+                  break;
+               }
+            }
+         }
+
+         globfree(&g);
       }
 
-      // Serial name
-      else
+      // The sets are shared out by the size of their particles files
+      for(t = 0; t < nsets; t++)
       {
-         sprintf(fname, "%s.*.AHF_halos", halo_file);
+         if(stat(halo_sets[t].fnames[0], &st) == 0)
+         {
+            halo_sets[t].size = st.st_size;
+         }
+      }
+
+      assign_halo_sets(nsets);
+   }
 
+   // Hand out the table
+   MPI_Bcast(halo_sets, nsets * sizeof(HALO_SET), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+   // Start out with the first set this task reads. With one file set
+   // everyone gets its names
+   halo_set_count = 0;
+
+   for(t = nsets - 1; t >= 0; t--)
+   {
+      if(reads_halo_set(t))
+      {
+         select_halo_set(t);
+         halo_set_count++;
       }
    }
 
-   sprintf(command, "/bin/ls %s", fname);
+   if(halo_set_count == 0)
+   {
+      select_halo_set(0);
+   }
+
+   #ifdef PROFILING
+      end_time = MPI_Wtime();
+
+      if(thistask == 0)
+      {
+         printf("Found the AHF files in %e secs\n", end_time - start_time);
+      }
+   #endif
+}
+
+
+
+/***********************
+    get_halo_fname
+***********************/
+char *get_halo_fname(char *ftype)
+{
+   // Returns a copy of the name of the AHF file of type ftype in the set being
+   // read: "p" for particles, "s" for substructure and "h" for halos. See
+   // find_halo_fnames and select_halo_set
+
+   int i = 0;
+   char *buf;
 
-   // Run the ls command. The only matching option should be the file I need.
-   // This is run to expand the wildcard character
-   if((fp = popen(command, "r")) == NULL)
+   if(strcmp(ftype, "s") == 0)
    {
-      printf("Error, did not run command!\n");
-      exit(EXIT_FAILURE);
+      i = 1;
    }
 
-   if(fgets(f_to_open, sizeof(f_to_open) - 1, fp))
+   else if(strcmp(ftype, "h") == 0)
+   {
+      i = 2;
+   }
+
+   if(!(buf = calloc(sizeof(ahf_fnames[i]), sizeof(char))))
    {
-      // ls appends a newline, so we have to get rid of it
-      split_str = strtok(f_to_open, "\n");
-      strcpy(buf, split_str);
+      printf("Error, could not allocate memory for buf!\n");
+      exit(EXIT_FAILURE);   
    }
 
-   pclose(fp);
+   strcpy(buf, ahf_fnames[i]);
 
    return buf;
 }
@@ -0,0 +1,792 @@
+/************************************************
+Title: hdf5_io.c
+Purpose: Contains functions for reading Gadget/AREPO
+         HDF5 snapshots and writing the -tspec output
+         as HDF5
+Notes:   * Only used with HDF5_SNAPSHOT, which implies
+           PARALLEL_READ
+         * Segments are snapfile.hdf5 for a single file
+           or snapfile.%d.hdf5 for more than one
+         * In HDF5 snapshots the gas is PartType0, but
+           the rest of tspec treats type 1 as the gas, so
+           types 0 and 1 are swapped when the header is
+           read and swapped back when it's written
+         * Every task opens the files on its own with the
+           serial library, so parallel HDF5 isn't needed
+************************************************/
+#ifdef HDF5_SNAPSHOT
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+#include <hdf5.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+    load_header_hdf5
+***********************/
+IO_HEADER load_header_hdf5(void)
+{
+   // Same as load_header, but reads the attributes of the Header group of the
+   // first segment
+
+   char fname[256];
+   FILE *fd;
+   hid_t file;
+   IO_HEADER h;
+
+   // The master header isn't set yet, so we don't know which name the first
+   // segment has. Check with fopen, since a failed H5Fopen prints a trace
+   if(snprintf(fname, sizeof(fname), "%s.hdf5", snapfile) >= (int)sizeof(fname))
+   {
+      printf("Error, the snapshot file name is too long!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(!(fd = fopen(fname, "rb")))
+   {
+      if(snprintf(fname, sizeof(fname), "%s.%d.hdf5", snapfile, 0) >= (int)sizeof(fname))
+      {
+         printf("Error, the snapshot file name is too long!\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   else
+   {
+      fclose(fd);
+   }
+
+   if((file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT)) < 0)
+   {
+      printf("Error, could not open hdf5 snapshot for reading header!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   read_hdf5_header(file, &h);
+
+   H5Fclose(file);
+
+   // Do a quick error check on the redshift to make sure it's within
+   // the bounds of the HM table
+   if(h.redshift > 9.479)
+   {
+      printf("Error, snapshot's z is outside bounds of HM table!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   return h;
+}
+
+
+
+/***********************
+    read_hdf5_header
+***********************/
+void read_hdf5_header(hid_t file, IO_HEADER *h)
+{
+   // Fills in h from the Header group's attributes. Anything that isn't in
+   // an HDF5 header is left as zero
+
+   int k;
+   int itmp;
+   double dtmp;
+   unsigned int npart_tot[6];
+   unsigned int high_word[6];
+   hid_t group;
+
+   memset(h, 0, sizeof(IO_HEADER));
+
+   if((group = H5Gopen(file, "/Header", H5P_DEFAULT)) < 0)
+   {
+      printf("Error, hdf5 snapshot has no Header group!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   read_hdf5_attribute(group, "NumPart_ThisFile", H5T_NATIVE_INT, h->npart);
+   read_hdf5_attribute(group, "NumPart_Total", H5T_NATIVE_UINT, npart_tot);
+   read_hdf5_attribute(group, "MassTable", H5T_NATIVE_DOUBLE, h->mass);
+   read_hdf5_attribute(group, "Time", H5T_NATIVE_DOUBLE, &h->time);
+   read_hdf5_attribute(group, "Redshift", H5T_NATIVE_DOUBLE, &h->redshift);
+   read_hdf5_attribute(group, "NumFilesPerSnapshot", H5T_NATIVE_INT, &h->num_files);
+   read_hdf5_attribute(group, "BoxSize", H5T_NATIVE_DOUBLE, &h->BoxSize);
+   read_hdf5_attribute(group, "Omega0", H5T_NATIVE_DOUBLE, &h->Omega0);
+   read_hdf5_attribute(group, "OmegaLambda", H5T_NATIVE_DOUBLE, &h->OmegaLambda);
+   read_hdf5_attribute(group, "HubbleParam", H5T_NATIVE_DOUBLE, &h->HubbleParam);
+
+   // Counts past 2^32 are split across two words. tspec keeps the counts in
+   // ints, so those snapshots are too big for it anyway
+   if(H5Aexists(group, "NumPart_Total_HighWord") > 0)
+   {
+      read_hdf5_attribute(group, "NumPart_Total_HighWord", H5T_NATIVE_UINT, high_word);
+
+      for(k = 0; k < 6; k++)
+      {
+         if(high_word[k] != 0)
+         {
+            printf("Error, too many particles in hdf5 snapshot!\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+   }
+
+   for(k = 0; k < 6; k++)
+   {
+      h->npartTotal[k] = npart_tot[k];
+   }
+
+   if(H5Aexists(group, "Flag_Sfr") > 0)
+   {
+      read_hdf5_attribute(group, "Flag_Sfr", H5T_NATIVE_INT, &h->flag_sfr);
+   }
+
+   if(H5Aexists(group, "Flag_Feedback") > 0)
+   {
+      read_hdf5_attribute(group, "Flag_Feedback", H5T_NATIVE_INT, &h->flag_feedback);
+   }
+
+   if(H5Aexists(group, "Flag_Cooling") > 0)
+   {
+      read_hdf5_attribute(group, "Flag_Cooling", H5T_NATIVE_INT, &h->flag_cooling);
+   }
+
+   H5Gclose(group);
+
+   // Put the gas (PartType0) where the rest of the code expects it
+   itmp = h->npart[0];
+   h->npart[0] = h->npart[1];
+   h->npart[1] = itmp;
+
+   itmp = h->npartTotal[0];
+   h->npartTotal[0] = h->npartTotal[1];
+   h->npartTotal[1] = itmp;
+
+   dtmp = h->mass[0];
+   h->mass[0] = h->mass[1];
+   h->mass[1] = dtmp;
+}
+
+
+
+/***********************
+   read_hdf5_attribute
+***********************/
+void read_hdf5_attribute(hid_t loc, char *name, hid_t type, void *buf)
+{
+   // Reads the whole of attribute name on loc into buf as type
+
+   hid_t attr;
+
+   if((attr = H5Aopen(loc, name, H5P_DEFAULT)) < 0)
+   {
+      printf("Error, could not open hdf5 attribute %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   if(H5Aread(attr, type, buf) < 0)
+   {
+      printf("Error, could not read hdf5 attribute %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   H5Aclose(attr);
+}
+
+
+
+/***********************
+   get_hdf5_filename
+***********************/
+void get_hdf5_filename(int seg, char *fname, size_t size)
+{
+   // Puts the name of HDF5 snapshot segment seg in fname, which has room for
+   // size characters
+
+   int len;
+
+   if(header.num_files > 1)
+   {
+      len = snprintf(fname, size, "%s.%d.hdf5", snapfile, seg);
+   }
+
+   else
+   {
+      len = snprintf(fname, size, "%s.hdf5", snapfile);
+   }
+
+   if((len < 0) || ((size_t)len >= size))
+   {
+      printf("Error, the name of snapshot segment %d is too long!\n", seg);
+      exit(EXIT_FAILURE);
+   }
+}
+
+
+
+/***********************
+   load_snapshot_hdf5
+***********************/
+PARTICLE_DATA *load_snapshot_hdf5(void)
+{
+   // The HDF5 version of load_snapshot_parallel. The gas is split evenly
+   // between the tasks in file order, and every task reads just its slice of
+   // the PartType0 datasets it needs with a hyperslab. The particles are then
+   // sent to the task that owns their id, the same as with the binary
+   // snapshots. Requires header to have been set on every task.
+
+   int i;
+   int n;
+   int nmine;
+   int nread = 0;
+   int first_id;
+   int *seg_npart;
+   long seg_start = 0;
+   long my_start;
+   long my_end;
+   long lo;
+   long hi;
+   char fname[256];
+   double nbytes = 0.0;
+   hid_t file;
+   hid_t group;
+   PARTICLE_DATA *mine;
+   PARTICLE_DATA *P;
+
+   #ifdef PROFILING
+      double start;
+      double end;
+      double tot_bytes;
+
+      start = MPI_Wtime();
+   #endif
+
+   // Get the number of gas particles in each segment
+   seg_npart = get_segment_npart_hdf5();
+
+   // This task's slice of the gas, counted across every segment in order
+   get_slab(thistask, header.npartTotal[1], &first_id, &nmine);
+   my_start = first_id - 1;
+   my_end = my_start + nmine;
+
+   mine = alloc_particles(nmine);
+
+   for(i = 0; i < header.num_files; seg_start += seg_npart[i], i++)
+   {
+      // Skip segments that don't overlap this task's slice
+      lo = (my_start > seg_start) ? my_start : seg_start;
+      hi = (my_end < seg_start + seg_npart[i]) ? my_end : seg_start + seg_npart[i];
+
+      if(hi <= lo)
+      {
+         continue;
+      }
+
+      n = hi - lo;
+      lo -= seg_start;
+
+      get_hdf5_filename(i, fname, sizeof(fname));
+
+      if((file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT)) < 0)
+      {
+         printf("Error, task %d could not open hdf5 snapshot segment %d!\n", thistask, i);
+         exit(EXIT_FAILURE);
+      }
+
+      if((group = H5Gopen(file, "/PartType0", H5P_DEFAULT)) < 0)
+      {
+         printf("Error, hdf5 snapshot segment %d has no PartType0 group!\n", i);
+         exit(EXIT_FAILURE);
+      }
+
+      // Each dataset is read straight into its field. Only the ids and
+      // densities are kept in memory (see PARTICLE_DATA)
+      read_hdf5_slab(group, "ParticleIDs", H5T_NATIVE_INT, 1, lo, n, mine->id + nread);
+      read_hdf5_slab(group, "Density", H5T_NATIVE_FLOAT, 1, lo, n, mine->density + nread);
+
+      H5Gclose(group);
+      H5Fclose(file);
+
+      nbytes += (double)n * (sizeof(int) + sizeof(float));
+
+      // The next segment's particles go after these
+      nread += n;
+   }
+
+   free(seg_npart);
+
+   #ifdef PROFILING
+      end = MPI_Wtime();
+      MPI_Reduce(&nbytes, &tot_bytes, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+      MPI_Allreduce(MPI_IN_PLACE, &end, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+      if(thistask == 0)
+      {
+         printf("Read %e MB of hdf5 snapshot data in %e secs (%e MB/s)\n",
+                tot_bytes / 1048576.0, end - start, tot_bytes / 1048576.0 / (end - start));
+      }
+   #endif
+
+   // Send everything to its owner
+   P = redistribute_particles(mine);
+
+   free_particles(mine);
+
+   return P;
+}
+
+
+
+/***********************
+ get_segment_npart_hdf5
+***********************/
+int *get_segment_npart_hdf5(void)
+{
+   // Root reads the header of every segment and sends everyone the number of
+   // gas particles in each
+
+   int i;
+   int *seg_npart;
+   char fname[256];
+   hid_t file;
+   IO_HEADER theader;
+
+   if(!(seg_npart = calloc(header.num_files, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for seg_npart!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(thistask == 0)
+   {
+      for(i = 0; i < header.num_files; i++)
+      {
+         get_hdf5_filename(i, fname, sizeof(fname));
+
+         if((file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT)) < 0)
+         {
+            printf("Error, could not open hdf5 snapshot segment %d!\n", i);
+            exit(EXIT_FAILURE);
+         }
+
+         read_hdf5_header(file, &theader);
+         seg_npart[i] = theader.npart[1];
+
+         H5Fclose(file);
+      }
+   }
+
+   MPI_Bcast(seg_npart, header.num_files, MPI_INT, 0, MPI_COMM_WORLD);
+
+   return seg_npart;
+}
+
+
+
+/***********************
+read_hdf5_segment_chunk
+***********************/
+void read_hdf5_segment_chunk(int seg, char *name, hid_t type, int ncols, long start, int n,
+                             void *buf)
+{
+   // Opens snapshot segment seg and reads rows start to start + n of its
+   // PartType0 dataset name into buf (see read_hdf5_slab)
+
+   char fname[256];
+   hid_t file;
+   hid_t group;
+
+   get_hdf5_filename(seg, fname, sizeof(fname));
+
+   if((file = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT)) < 0)
+   {
+      printf("Error, task %d could not open hdf5 snapshot segment %d!\n", thistask, seg);
+      exit(EXIT_FAILURE);
+   }
+
+   if((group = H5Gopen(file, "/PartType0", H5P_DEFAULT)) < 0)
+   {
+      printf("Error, hdf5 snapshot segment %d has no PartType0 group!\n", seg);
+      exit(EXIT_FAILURE);
+   }
+
+   read_hdf5_slab(group, name, type, ncols, start, n, buf);
+
+   H5Gclose(group);
+   H5Fclose(file);
+}
+
+
+
+/***********************
+ get_hdf5_dataset_name
+***********************/
+char *get_hdf5_dataset_name(enum fields blocknr)
+{
+   // Returns the name of the PartType0 dataset that holds blocknr
+
+   switch(blocknr)
+   {
+      case POS:
+         return "Coordinates";
+
+      case VEL:
+         return "Velocities";
+
+      case IDS:
+         return "ParticleIDs";
+
+      case MASS:
+         return "Masses";
+
+      case RHO:
+         return "Density";
+
+      case HSML:
+         return "SmoothingLength";
+
+      default:
+         printf("Error, there's no hdf5 dataset for block %d!\n", blocknr);
+         exit(EXIT_FAILURE);
+   }
+}
+
+
+
+/***********************
+     read_hdf5_slab
+***********************/
+void read_hdf5_slab(hid_t group, char *name, hid_t type, int ncols, long start, int n, void *buf)
+{
+   // Reads rows start to start + n of dataset name in group into buf as type.
+   // HDF5 converts from whatever's in the file (doubles, 64 bit ids, ...)
+
+   hid_t dset;
+   hid_t fspace;
+   hid_t mspace;
+   hsize_t offset[2];
+   hsize_t count[2];
+
+   if((dset = H5Dopen(group, name, H5P_DEFAULT)) < 0)
+   {
+      printf("Error, could not open hdf5 dataset %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   offset[0] = start;
+   offset[1] = 0;
+   count[0] = n;
+   count[1] = ncols;
+
+   fspace = H5Dget_space(dset);
+
+   if(H5Sselect_hyperslab(fspace, H5S_SELECT_SET, offset, NULL, count, NULL) < 0)
+   {
+      printf("Error, could not select slab of hdf5 dataset %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   mspace = H5Screate_simple((ncols > 1) ? 2 : 1, count, NULL);
+
+   if(H5Dread(dset, type, mspace, fspace, H5P_DEFAULT, buf) < 0)
+   {
+      printf("Error, could not read hdf5 dataset %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   H5Sclose(mspace);
+   H5Sclose(fspace);
+   H5Dclose(dset);
+}
+
+
+
+/***********************
+write_particle_data_hdf5
+***********************/
+void write_particle_data_hdf5(PARTICLE_DATA *P)
+{
+   // The HDF5 version of write_particle_data. Root creates snapfile-tspec.hdf5
+   // with the header and empty, chunked (and, with HDF5_COMPRESSION, gzipped)
+   // datasets. The tasks then take turns writing their particles into their
+   // rows, a dataset at a time, so nothing is gathered onto root. P is in id
+   // order on every task and the tasks hold consecutive id ranges, so the
+   // output is in id order.
+
+   int i;
+   int n_before = 0;
+   enum fields passthrough[3] = {POS, VEL, HSML};
+   float *buf;
+   char tspec_file[256];
+   hid_t file;
+   hid_t group;
+
+   if(snprintf(tspec_file, sizeof(tspec_file), "%s-tspec.hdf5", snapfile) >=
+      (int)sizeof(tspec_file))
+   {
+      printf("Error, the output file name is too long!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   // Where this task's rows start
+   MPI_Exscan(&P->n, &n_before, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
+   if(thistask == 0)
+   {
+      n_before = 0;
+
+      if((file = H5Fcreate(tspec_file, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT)) < 0)
+      {
+         printf("Error, could not create hdf5 output file!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      write_hdf5_header(file);
+
+      group = H5Gcreate(file, "/PartType0", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+      create_hdf5_dataset(group, "Coordinates", H5T_NATIVE_FLOAT, 3, header.npartTotal[1]);
+      create_hdf5_dataset(group, "Velocities", H5T_NATIVE_FLOAT, 3, header.npartTotal[1]);
+      create_hdf5_dataset(group, "ParticleIDs", H5T_NATIVE_INT, 1, header.npartTotal[1]);
+      create_hdf5_dataset(group, "Temperature", H5T_NATIVE_FLOAT, 1, header.npartTotal[1]);
+      create_hdf5_dataset(group, "Density", H5T_NATIVE_FLOAT, 1, header.npartTotal[1]);
+      create_hdf5_dataset(group, "SmoothingLength", H5T_NATIVE_FLOAT, 1, header.npartTotal[1]);
+
+      H5Gclose(group);
+      H5Fclose(file);
+   }
+
+   // What tspec keeps in memory is written straight from P
+   write_hdf5_in_turns(tspec_file, "ParticleIDs", H5T_NATIVE_INT, 1, n_before, P->n, P->id);
+   write_hdf5_in_turns(tspec_file, "Temperature", H5T_NATIVE_FLOAT, 1, n_before, P->n, P->temp);
+   write_hdf5_in_turns(tspec_file, "Density", H5T_NATIVE_FLOAT, 1, n_before, P->n, P->density);
+
+   // pos, vel and hsml are copied from the snapshot one field at a time
+   for(i = 0; i < 3; i++)
+   {
+      buf = load_passthrough_field(P, passthrough[i], NULL);
+      write_hdf5_in_turns(tspec_file, get_hdf5_dataset_name(passthrough[i]), H5T_NATIVE_FLOAT,
+                          get_passthrough_ncomp(passthrough[i]), n_before, P->n, buf);
+      free(buf);
+   }
+
+   free_particles(P);
+}
+
+
+
+/***********************
+  write_hdf5_in_turns
+***********************/
+void write_hdf5_in_turns(char *tspec_file, char *name, hid_t type, int ncols, long start, int n,
+                         void *buf)
+{
+   // Writes n rows of buf to rows start to start + n of the PartType0 dataset
+   // name in tspec_file. Only one task can have the file open for writing at
+   // a time, so the tasks take turns. Every task has to call this
+
+   int i;
+   hid_t file;
+   hid_t group;
+
+   for(i = 0; i < ntasks; i++)
+   {
+      if((i == thistask) && (n > 0))
+      {
+         if((file = H5Fopen(tspec_file, H5F_ACC_RDWR, H5P_DEFAULT)) < 0)
+         {
+            printf("Error, task %d could not open hdf5 output file!\n", thistask);
+            exit(EXIT_FAILURE);
+         }
+
+         group = H5Gopen(file, "/PartType0", H5P_DEFAULT);
+
+         write_hdf5_slab(group, name, type, ncols, start, n, buf);
+
+         H5Gclose(group);
+         H5Fclose(file);
+      }
+
+      MPI_Barrier(MPI_COMM_WORLD);
+   }
+}
+
+
+
+/***********************
+    write_hdf5_header
+***********************/
+void write_hdf5_header(hid_t file)
+{
+   // Writes the Header group for the output. Like write_particle_data, the
+   // output is a single file holding just the gas, which goes back to being
+   // PartType0
+
+   int k;
+   int one = 1;
+   int npart[6];
+   unsigned int npart_tot[6];
+   double mass[6];
+   hid_t group;
+
+   for(k = 0; k < 6; k++)
+   {
+      npart[k] = 0;
+      npart_tot[k] = 0;
+      mass[k] = header.mass[k];
+   }
+
+   npart[0] = header.npartTotal[1];
+   npart_tot[0] = header.npartTotal[1];
+   mass[0] = header.mass[1];
+   mass[1] = header.mass[0];
+
+   group = H5Gcreate(file, "/Header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+   write_hdf5_attribute(group, "NumPart_ThisFile", H5T_NATIVE_INT, 6, npart);
+   write_hdf5_attribute(group, "NumPart_Total", H5T_NATIVE_UINT, 6, npart_tot);
+   write_hdf5_attribute(group, "MassTable", H5T_NATIVE_DOUBLE, 6, mass);
+   write_hdf5_attribute(group, "Time", H5T_NATIVE_DOUBLE, 1, &header.time);
+   write_hdf5_attribute(group, "Redshift", H5T_NATIVE_DOUBLE, 1, &header.redshift);
+   write_hdf5_attribute(group, "NumFilesPerSnapshot", H5T_NATIVE_INT, 1, &one);
+   write_hdf5_attribute(group, "BoxSize", H5T_NATIVE_DOUBLE, 1, &header.BoxSize);
+   write_hdf5_attribute(group, "Omega0", H5T_NATIVE_DOUBLE, 1, &header.Omega0);
+   write_hdf5_attribute(group, "OmegaLambda", H5T_NATIVE_DOUBLE, 1, &header.OmegaLambda);
+   write_hdf5_attribute(group, "HubbleParam", H5T_NATIVE_DOUBLE, 1, &header.HubbleParam);
+   write_hdf5_attribute(group, "Flag_Sfr", H5T_NATIVE_INT, 1, &header.flag_sfr);
+   write_hdf5_attribute(group, "Flag_Feedback", H5T_NATIVE_INT, 1, &header.flag_feedback);
+   write_hdf5_attribute(group, "Flag_Cooling", H5T_NATIVE_INT, 1, &header.flag_cooling);
+
+   H5Gclose(group);
+}
+
+
+
+/***********************
+  write_hdf5_attribute
+***********************/
+void write_hdf5_attribute(hid_t loc, char *name, hid_t type, int n, void *buf)
+{
+   // Writes the n values in buf to a new attribute name on loc
+
+   hsize_t dims[1];
+   hid_t space;
+   hid_t attr;
+
+   dims[0] = n;
+
+   if(n == 1)
+   {
+      space = H5Screate(H5S_SCALAR);
+   }
+
+   else
+   {
+      space = H5Screate_simple(1, dims, NULL);
+   }
+
+   if(((attr = H5Acreate(loc, name, type, space, H5P_DEFAULT, H5P_DEFAULT)) < 0) ||
+      (H5Awrite(attr, type, buf) < 0))
+   {
+      printf("Error, could not write hdf5 attribute %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   H5Aclose(attr);
+   H5Sclose(space);
+}
+
+
+
+/***********************
+   create_hdf5_dataset
+***********************/
+void create_hdf5_dataset(hid_t group, char *name, hid_t type, int ncols, long n)
+{
+   // Creates an n x ncols dataset in group. It's chunked in HDF5_CHUNK rows so
+   // that it can be compressed with HDF5_COMPRESSION, if that's set
+
+   int rank;
+   hsize_t dims[2];
+   hsize_t chunk[2];
+   hid_t space;
+   hid_t dcpl;
+   hid_t dset;
+
+   rank = (ncols > 1) ? 2 : 1;
+   dims[0] = n;
+   dims[1] = ncols;
+
+   space = H5Screate_simple(rank, dims, NULL);
+   dcpl = H5Pcreate(H5P_DATASET_CREATE);
+
+   // Chunks can't be empty or bigger than the dataset
+   if(n > 0)
+   {
+      chunk[0] = (n < HDF5_CHUNK) ? n : HDF5_CHUNK;
+      chunk[1] = ncols;
+
+      H5Pset_chunk(dcpl, rank, chunk);
+
+      #ifdef HDF5_COMPRESSION
+         H5Pset_shuffle(dcpl);
+         H5Pset_deflate(dcpl, HDF5_COMPRESSION);
+      #endif
+   }
+
+   if((dset = H5Dcreate(group, name, type, space, H5P_DEFAULT, dcpl, H5P_DEFAULT)) < 0)
+   {
+      printf("Error, could not create hdf5 dataset %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   H5Dclose(dset);
+   H5Pclose(dcpl);
+   H5Sclose(space);
+}
+
+
+
+/***********************
+    write_hdf5_slab
+***********************/
+void write_hdf5_slab(hid_t group, char *name, hid_t type, int ncols, long start, int n, void *buf)
+{
+   // Writes buf to rows start to start + n of dataset name in group
+
+   hid_t dset;
+   hid_t fspace;
+   hid_t mspace;
+   hsize_t offset[2];
+   hsize_t count[2];
+
+   if((dset = H5Dopen(group, name, H5P_DEFAULT)) < 0)
+   {
+      printf("Error, could not open hdf5 dataset %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   offset[0] = start;
+   offset[1] = 0;
+   count[0] = n;
+   count[1] = ncols;
+
+   fspace = H5Dget_space(dset);
+   H5Sselect_hyperslab(fspace, H5S_SELECT_SET, offset, NULL, count, NULL);
+   mspace = H5Screate_simple((ncols > 1) ? 2 : 1, count, NULL);
+
+   if(H5Dwrite(dset, type, mspace, fspace, H5P_DEFAULT, buf) < 0)
+   {
+      printf("Error, could not write hdf5 dataset %s!\n", name);
+      exit(EXIT_FAILURE);
+   }
+
+   H5Sclose(mspace);
+   H5Sclose(fspace);
+   H5Dclose(dset);
+}
+
+#endif
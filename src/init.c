@@ -121,12 +121,6 @@ void make_custom_mpi_type(void)
    MPI_Aint lb;
    MPI_Aint charex, intex, floatex, doublex;
 
-   // Particle type variables
-   int p_blocks[10] = {3,3,1,1,1,1,1,1,1,1};
-   MPI_Datatype p_types[10] = {MPI_FLOAT, MPI_FLOAT, MPI_FLOAT, MPI_FLOAT, MPI_FLOAT,\
-                            MPI_FLOAT, MPI_FLOAT, MPI_INT, MPI_INT, MPI_INT};
-   MPI_Aint p_disp[10];
-
    // Get the extents
    MPI_Type_get_extent(MPI_CHAR, &lb, &charex);
    MPI_Type_get_extent(MPI_INT, &lb, &intex);
@@ -152,20 +146,4 @@ void make_custom_mpi_type(void)
    // Make MPI header structure
    MPI_Type_create_struct(14, h_blocks, h_disp, h_types, &mpi_header_type);
    MPI_Type_commit(&mpi_header_type);
-
-   // Fill the particle displacements
-   p_disp[0] = (MPI_Aint)0;
-   p_disp[1] = 3 * floatex;
-   p_disp[2] = p_disp[1] + (3 * floatex);
-   p_disp[3] = p_disp[2] + floatex;
-   p_disp[4] = p_disp[3] + floatex;
-   p_disp[5] = p_disp[4] + floatex;
-   p_disp[6] = p_disp[5] + floatex;
-   p_disp[7] = p_disp[6] + floatex;
-   p_disp[8] = p_disp[7] + intex;
-   p_disp[9] = p_disp[8] + intex;
-
-   // Make the MPI particle type
-   MPI_Type_create_struct(10, p_blocks, p_disp, p_types, &mpi_particle_type);
-   MPI_Type_commit(&mpi_particle_type);
 }
@@ -8,6 +8,10 @@ Notes: These were mostly developed and tested in
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "allvars.h"
 #include "proto.h"
 
@@ -21,14 +25,13 @@ IO_HEADER load_header(void)
    // Reads the header from the snapshot. The header is
    // always 256 bytes. It, like every other block in the
    // snapshot, it padded by an integer that holds the
-   // size, in bytes, of the block
+   // size, in bytes, of the block. scan_blocks does the
+   // reading and checking, which means either SnapFormat
+   // works
 
    FILE *fd;
-   int blksize1 = 0;
-   int blksize2 = 1;
-   enum fields blocknr;
    char read_file[256];
-   IO_HEADER h;
+   BLOCK_DIR dir;
 
    // Open the file
    if(!(fd = fopen(snapfile, "rb")))
@@ -36,7 +39,11 @@ IO_HEADER load_header(void)
       // We could be here either because the file failed to load, or else
       // because there is more than one file per snapshot, so let's try
       // and load snapfile.0 first before quitting
-      sprintf(read_file, "%s.%d", snapfile, 0);
+      if(snprintf(read_file, sizeof(read_file), "%s.%d", snapfile, 0) >= (int)sizeof(read_file))
+      {
+         printf("Error, the snapshot file name is too long!\n");
+         exit(EXIT_FAILURE);
+      }
 
       if(!(fd = fopen(read_file, "rb")))
       {
@@ -45,15 +52,6 @@ IO_HEADER load_header(void)
       }
    }
 
-   // Read the header
-   my_fread(&blksize1, sizeof(int), 1, fd);
-   my_fread(&h, sizeof(IO_HEADER), 1, fd);
-   my_fread(&blksize2, sizeof(int), 1, fd);
-
-   // Close the file
-   fclose(fd);
-
-   // Check to make sure correct size was read and written
    // Check header size
    if(sizeof(IO_HEADER) != 256)
    {
@@ -61,18 +59,90 @@ IO_HEADER load_header(void)
       exit(EXIT_FAILURE);
    }
 
-   blocknr = HEADER;
-   block_check(blocknr, blksize1, blksize2, h);
+   // Read the header
+   scan_blocks(fd, &dir);
+
+   // Close the file
+   fclose(fd);
 
    // Do a quick error check on the redshift to make sure it's within
    // the bounds of the HM table
-   if(h.redshift > 9.479)
+   if(dir.header.redshift > 9.479)
    {
       printf("Error, snapshot's z is outside bounds of HM table!\n");
       exit(EXIT_FAILURE);
    }
 
-   return h;
+   return dir.header;
+}
+
+
+
+/***********************
+   get_snapshot_fname
+***********************/
+void get_snapshot_fname(int seg, char *fname, size_t size)
+{
+   // Puts the name of snapshot segment seg in fname, which has room for size
+   // characters
+
+   int len;
+
+   if(header.num_files > 1)
+   {
+      len = snprintf(fname, size, "%s.%d", snapfile, seg);
+   }
+
+   else
+   {
+      len = snprintf(fname, size, "%s", snapfile);
+   }
+
+   if((len < 0) || ((size_t)len >= size))
+   {
+      printf("Error, the name of snapshot segment %d is too long!\n", seg);
+      exit(EXIT_FAILURE);
+   }
+}
+
+
+
+/***********************
+ read_snapshot_segment
+***********************/
+PARTICLE_DATA *read_snapshot_segment(FILE *fd, IO_HEADER *th, double *nbytes)
+{
+   // Reads the gas particles in the segment open in fd and returns them in
+   // file order. Also fills in the segment's header and adds the number of
+   // bytes read to nbytes. Each field is read straight into its array, and
+   // only the gas part of each block is read. Only the ids and densities are
+   // kept in memory (see PARTICLE_DATA), so everything else is skipped over.
+
+   int ngas;
+   long first;
+   BLOCK_DIR dir;
+   PARTICLE_DATA *P;
+
+   // Find the blocks and read the header
+   scan_blocks(fd, &dir);
+   *th = dir.header;
+
+   // The gas comes after the type 0 particles in the blocks that hold every
+   // type. The sph blocks only hold the gas
+   ngas = dir.header.npart[1];
+   first = dir.header.npart[0];
+
+   P = alloc_particles(ngas);
+
+   if(ngas > 0)
+   {
+      read_block_chunk(fd, dir.offset[IDS], sizeof(int), first, ngas, P->id);
+      read_block_chunk(fd, dir.offset[RHO], sizeof(float), 0, ngas, P->density);
+   }
+
+   *nbytes += (double)ngas * (sizeof(int) + sizeof(float));
+
+   return P;
 }
 
 
@@ -80,260 +150,994 @@ IO_HEADER load_header(void)
 /***********************
      load_snapshot
 ***********************/
-PARTICLE_DATA *load_snapshot(int *ngas)
+PARTICLE_DATA *load_snapshot(void)
 {
-   // Does as the name says. Reads in snapshot segment file_num
+   // Does as the name says. Reads in every snapshot segment. Each gas
+   // particle goes straight into slot id - 1 of D as it's read (see
+   // place_particles), so D comes back in ascending id order
 
    int i;
-   int master;
-   int k;
-   int n;
-   int pc = 0;
-   int pc_new;
-   int pc_sph;
-   int blksize1;
-   int blksize2;
-   int numpart;
-   int n_with_masses;
+   int nplaced = 0;
+   int dense = 1;
    FILE *fd;
    char filename[256];
-   enum fields blocknr;
+   double nbytes = 0.0;
    IO_HEADER theader;
    PARTICLE_DATA *AP;
    PARTICLE_DATA *D;
 
-   // Open the file
-   if(header.num_files == 1)
+   #ifdef PROFILING
+      double start;
+      double end;
+
+      start = MPI_Wtime();
+   #endif
+
+   // D starts out zeroed, and place_particles uses id 0 to mark an empty slot
+   D = alloc_particles(header.npartTotal[1]);
+
+   // Loop over every snapshot segment
+   for(i = 0; i < header.num_files; i++)
    {
-      if(!(fd = fopen(snapfile, "rb")))
+      // Progress bar
+      printf("Loading snapshot file %d of %d\n", i + 1, header.num_files);
+
+      get_snapshot_fname(i, filename, sizeof(filename));
+
+      if(!(fd = fopen(filename, "rb")))
       {
-         printf("Error, could not open snapshot for reading!\n");
+         printf("Error, could not open snapshot segment for reading!\n");
          exit(EXIT_FAILURE);
       }
+
+      AP = read_snapshot_segment(fd, &theader, &nbytes);
+
+      place_particles(D, &nplaced, &dense, AP);
+
+      free_particles(AP);
+
+      // Close the file
+      fclose(fd);
    }
 
-   else
+   #ifdef PROFILING
+      end = MPI_Wtime();
+      printf("Read %e MB of snapshot data in %e secs (%e MB/s)\n", nbytes / 1048576.0,
+             end - start, nbytes / 1048576.0 / (end - start));
+   #endif
+
+   // Only needed if the ids turned out not to be dense
+   if(!dense)
+   {
+      sort_placed_particles(D);
+   }
+
+   return D;
+}
+
+
+
+/***********************
+    place_particles
+***********************/
+void place_particles(PARTICLE_DATA *D, int *nplaced, int *dense, PARTICLE_DATA *src)
+{
+   // Stores the particles in src in D, which must start out zeroed. Gadget's
+   // gas ids are 1..D->n, so each particle goes straight into slot id - 1 and
+   // D ends up in id order with no sort. The ids are placed first, and then
+   // every other field is scattered to the same slots one field at a time. If
+   // an id is out of range or its slot is already taken then the ids aren't
+   // dense. In that case what's been placed so far is packed down to the
+   // front of D, every particle from then on is just appended, and dense is
+   // cleared so the caller knows that D still has to be sorted with
+   // sort_placed_particles
+
+   int i;
+   int j;
+   int k;
+   int slot;
+   int nfit = 0;
+   size_t size;
+   char *from;
+   char *to;
+   PARTICLE_FIELD fd[NPFIELDS];
+   PARTICLE_FIELD fs[NPFIELDS];
+
+   if(*dense)
+   {
+      // Claim a slot for every id until one doesn't fit
+      for(nfit = 0; nfit < src->n; nfit++)
+      {
+         slot = src->id[nfit] - 1;
+
+         if((slot < 0) || (slot >= D->n) || (D->id[slot] != 0))
+         {
+            break;
+         }
+
+         D->id[slot] = src->id[nfit];
+      }
+
+      // The ids are already in place, so skip them
+      get_particle_fields(D, fd);
+      get_particle_fields(src, fs);
+
+      for(i = 1; i < NPFIELDS; i++)
+      {
+         if(*fs[i].data == NULL)
+         {
+            continue;
+         }
+
+         size = fs[i].size;
+         from = *fs[i].data;
+         to = *fd[i].data;
+
+         for(k = 0; k < nfit; k++)
+         {
+            memcpy(to + (size_t)(src->id[k] - 1) * size, from + (size_t)k * size, size);
+         }
+      }
+
+      *nplaced += nfit;
+
+      if(nfit == src->n)
+      {
+         return;
+      }
+
+      *dense = 0;
+
+      // Everything placed so far has an id of at least 1
+      for(i = 0, j = 0; i < D->n; i++)
+      {
+         if(D->id[i] != 0)
+         {
+            if(j != i)
+            {
+               copy_particle(D, j, D, i);
+            }
+
+            j++;
+         }
+      }
+   }
+
+   for(k = nfit; k < src->n; k++)
+   {
+      copy_particle(D, *nplaced, src, k);
+      (*nplaced)++;
+   }
+}
+
+
+
+/***********************
+ sort_placed_particles
+***********************/
+void sort_placed_particles(PARTICLE_DATA *D)
+{
+   // Falls back on a radix sort by id for when place_particles found that the
+   // ids weren't dense
+
+   #ifdef PROFILING
+      double start;
+      double end;
+
+      start = MPI_Wtime();
+   #endif
+
+   printf("Warning, gas ids aren't 1..%d, sorting them instead!\n", D->n);
+
+   sort_particles_by_id(D);
+
+   #ifdef PROFILING
+      end = MPI_Wtime();
+      printf("Sorted %d particles by id in %e secs\n", D->n, end - start);
+   #endif
+}
+
+
+
+/***********************
+ load_snapshot_parallel
+***********************/
+PARTICLE_DATA *load_snapshot_parallel(void)
+{
+   // Every task reads its own share of the snapshot segments at the same time
+   // and then the gas particles are sent to the task that owns their id (see
+   // get_slab). Root never holds more than its share. Requires header to
+   // have been set on every task.
+
+   int i;
+   int k;
+   int nmine = 0;
+   int *seg_owner;
+   FILE *fd;
+   char filename[256];
+   double nbytes = 0.0;
+   IO_HEADER theader;
+   PARTICLE_DATA *AP;
+   PARTICLE_DATA *mine;
+   PARTICLE_DATA *P;
+
+   #ifdef PROFILING
+      double start;
+      double end;
+      double tot_bytes;
+
+      start = MPI_Wtime();
+   #endif
+
+   mine = alloc_particles(0);
+
+   // Figure out which task reads which segment
+   seg_owner = assign_snapshot_segments();
+
+   for(i = 0; i < header.num_files; i++)
+   {
+      if(seg_owner[i] != thistask)
+      {
+         continue;
+      }
+
+      get_snapshot_fname(i, filename, sizeof(filename));
+
+      if(!(fd = fopen(filename, "rb")))
+      {
+         printf("Error, task %d could not open snapshot segment %d for reading!\n",
+                thistask, i);
+         exit(EXIT_FAILURE);
+      }
+
+      AP = read_snapshot_segment(fd, &theader, &nbytes);
+
+      fclose(fd);
+
+      // Keep the gas particles
+      resize_particles(mine, nmine + AP->n);
+
+      for(k = 0; k < AP->n; k++)
+      {
+         copy_particle(mine, nmine, AP, k);
+         nmine++;
+      }
+
+      free_particles(AP);
+   }
+
+   free(seg_owner);
+
+   #ifdef PROFILING
+      end = MPI_Wtime();
+      MPI_Reduce(&nbytes, &tot_bytes, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+      MPI_Allreduce(MPI_IN_PLACE, &end, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+      if(thistask == 0)
+      {
+         printf("Read %e MB of snapshot data in %e secs (%e MB/s)\n", tot_bytes / 1048576.0,
+                end - start, tot_bytes / 1048576.0 / (end - start));
+      }
+   #endif
+
+   // Send everything to its owner
+   P = redistribute_particles(mine);
+
+   free_particles(mine);
+
+   return P;
+}
+
+
+
+/***********************
+assign_snapshot_segments
+***********************/
+int *assign_snapshot_segments(void)
+{
+   // Hands out the snapshot segments to the tasks by size. Root looks at the
+   // size of each file and gives the biggest remaining one to the task with
+   // the fewest bytes so far. The owner of every segment is returned.
+
+   int i;
+   int j;
+   int big;
+   int least;
+   int *seg_owner;
+   int *done;
+   long *load;
+   long *seg_size;
+   char filename[256];
+   struct stat st;
+
+   if(!(seg_owner = calloc(header.num_files, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for seg_owner!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(thistask == 0)
    {
-      // Allocate memory for D
-      if(!(D = calloc(header.npartTotal[1], sizeof(PARTICLE_DATA))))
+      if(!(seg_size = calloc(header.num_files, sizeof(long))) ||
+         !(done = calloc(header.num_files, sizeof(int))) ||
+         !(load = calloc(ntasks, sizeof(long))))
       {
-         printf("Error, could not allocate memory for all particles!\n");
+         printf("Error, could not allocate memory for segment assignment!\n");
          exit(EXIT_FAILURE);
       }
 
-      // Initialize master index
-      master = 0;
+      for(i = 0; i < header.num_files; i++)
+      {
+         get_snapshot_fname(i, filename, sizeof(filename));
+
+         if(stat(filename, &st) != 0)
+         {
+            printf("Error, could not stat snapshot segment %d!\n", i);
+            exit(EXIT_FAILURE);
+         }
+
+         seg_size[i] = st.st_size;
+      }
+
+      for(i = 0; i < header.num_files; i++)
+      {
+         // Biggest segment that hasn't been handed out yet
+         for(j = 0, big = -1; j < header.num_files; j++)
+         {
+            if(!done[j] && ((big < 0) || (seg_size[j] > seg_size[big])))
+            {
+               big = j;
+            }
+         }
+
+         // Least loaded task
+         for(j = 1, least = 0; j < ntasks; j++)
+         {
+            if(load[j] < load[least])
+            {
+               least = j;
+            }
+         }
+
+         seg_owner[big] = least;
+         load[least] += seg_size[big];
+         done[big] = 1;
+      }
+
+      free(seg_size);
+      free(done);
+      free(load);
    }
 
+   MPI_Bcast(seg_owner, header.num_files, MPI_INT, 0, MPI_COMM_WORLD);
+
+   return seg_owner;
+}
+
+
+
+/***********************
+ redistribute_particles
+***********************/
+PARTICLE_DATA *redistribute_particles(PARTICLE_DATA *mine)
+{
+   // Sends each of the particles in mine to the task that owns its id with
+   // one MPI_Alltoallv per field. The returned particles are this task's id
+   // range in ascending id order.
+
+   int i;
+   int ngas;
+   int nrecv;
+   int first_id;
+   int n;
+   int index;
+   int *owner;
+   int *sendcnts;
+   int *recvcnts;
+   int *sdispls;
+   int *rdispls;
+   int *offset;
+   PARTICLE_DATA *sbuf;
+   PARTICLE_DATA *rbuf;
+   PARTICLE_DATA *P;
+
+   ngas = header.npartTotal[1];
+
+   if(!(sendcnts = calloc(ntasks, sizeof(int))) || !(recvcnts = calloc(ntasks, sizeof(int))) ||
+      !(sdispls = calloc(ntasks, sizeof(int))) || !(rdispls = calloc(ntasks, sizeof(int))) ||
+      !(offset = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for redistribution counts!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   // Bucket the particles by owner
+   owner = alloc_field(mine->n, sizeof(int));
+
+   for(i = 0; i < mine->n; i++)
+   {
+      owner[i] = pid_owner(mine->id[i], ngas);
+      sendcnts[owner[i]]++;
+   }
+
+   for(i = 1; i < ntasks; i++)
+   {
+      sdispls[i] = sdispls[i - 1] + sendcnts[i - 1];
+   }
+
+   memcpy(offset, sdispls, ntasks * sizeof(int));
+
+   sbuf = alloc_particles(mine->n);
+
+   for(i = 0; i < mine->n; i++)
+   {
+      copy_particle(sbuf, offset[owner[i]]++, mine, i);
+   }
+
+   free(owner);
+
+   // Tell everyone how much is coming
+   MPI_Alltoall(sendcnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
+
+   for(i = 1; i < ntasks; i++)
+   {
+      rdispls[i] = rdispls[i - 1] + recvcnts[i - 1];
+   }
+
+   nrecv = rdispls[ntasks - 1] + recvcnts[ntasks - 1];
+
+   rbuf = alloc_particles(nrecv);
+
+   exchange_particles(sbuf, sendcnts, sdispls, rbuf, recvcnts, rdispls);
+
+   free_particles(sbuf);
+
+   // Put every particle in its place
+   get_slab(thistask, ngas, &first_id, &n);
+
+   if(nrecv != n)
+   {
+      printf("Error, task %d received %d particles but owns %d ids!\n", thistask, nrecv, n);
+      exit(EXIT_FAILURE);
+   }
+
+   P = alloc_particles(n);
+
+   for(i = 0; i < nrecv; i++)
+   {
+      index = rbuf->id[i] - first_id;
+
+      if((index < 0) || (index >= n))
+      {
+         printf("Error, particle id %d is outside of the gas id range!\n", rbuf->id[i]);
+         exit(EXIT_FAILURE);
+      }
+
+      copy_particle(P, index, rbuf, i);
+   }
+
+   free_particles(rbuf);
+   free(sendcnts);
+   free(recvcnts);
+   free(sdispls);
+   free(rdispls);
+   free(offset);
+
+   return P;
+}
+
+
+
+/***********************
+        get_slab
+***********************/
+void get_slab(int task, int ngas, int *first_id, int *n)
+{
+   // Gets the range of ids owned by task when the gas is spread over the
+   // tasks. This is the same split as in split_particles: every task gets
+   // ngas / ntasks particles and the last one also takes what's left over.
+
+   int n_per_task;
+
+   n_per_task = ngas / ntasks;
+
+   *first_id = task * n_per_task + 1;
+   *n = n_per_task;
+
+   if(task == (ntasks - 1))
+   {
+      *n += ngas - (ntasks * n_per_task);
+   }
+}
+
+
+
+/***********************
+       pid_owner
+***********************/
+int pid_owner(int pid, int ngas)
+{
+   // Returns the task whose slab holds pid (see get_slab)
+
+   int n_per_task;
+   int owner;
+
+   n_per_task = ngas / ntasks;
+
+   if(n_per_task == 0)
+   {
+      return ntasks - 1;
+   }
+
+   owner = (pid - 1) / n_per_task;
+
+   if(owner > (ntasks - 1))
+   {
+      owner = ntasks - 1;
+   }
+
+   return owner;
+}
+
+
+
+/***********************
+   load_snapshot_mmap
+***********************/
+PARTICLE_DATA *load_snapshot_mmap(void)
+{
+   // Same as load_snapshot, but each segment is memory-mapped instead of
+   // read. The gas fields are copied straight from the mapping into their
+   // final place in D, so there's no fread buffer and no per-segment AP copy.
+   // Like load_snapshot, D comes back in id order
+
+   int i;
+   int nplaced = 0;
+   int dense = 1;
+   char filename[256];
+   SNAP_SEGMENT seg;
+   PARTICLE_DATA view;
+   PARTICLE_DATA *D;
+
+   #ifdef PROFILING
+      double start;
+      double end;
+      double nbytes = 0.0;
+
+      start = MPI_Wtime();
+   #endif
+
+   D = alloc_particles(header.npartTotal[1]);
+
    // Loop over every snapshot segment
    for(i = 0; i < header.num_files; i++)
    {
       // Progress bar
-      printf("Loading snapshot file %d of %d\n", i + 1, header.num_files);
+      printf("Mapping snapshot file %d of %d\n", i + 1, header.num_files);
+
+      get_snapshot_fname(i, filename, sizeof(filename));
+
+      seg = map_snapshot_segment(filename);
+
+      // The view just points into the mapping. map_snapshot_segment has
+      // already moved the ids past the type 0 particles, the same as
+      // read_snapshot_segment
+      memset(&view, 0, sizeof(PARTICLE_DATA));
+      view.n = seg.header.npart[1];
+      view.id = seg.id;
+      view.density = seg.density;
+
+      place_particles(D, &nplaced, &dense, &view);
+
+      #ifdef PROFILING
+         nbytes += seg.length;
+      #endif
+
+      // Drop the mapping before moving on so that only one segment is ever
+      // mapped at a time
+      unmap_snapshot_segment(&seg);
+   }
+
+   #ifdef PROFILING
+      end = MPI_Wtime();
+      printf("Mapped %e MB of snapshot data in %e secs (%e MB/s)\n", nbytes / 1048576.0,
+             end - start, nbytes / 1048576.0 / (end - start));
+   #endif
+
+   if(!dense)
+   {
+      sort_placed_particles(D);
+   }
+
+   return D;
+}
+
+
+
+/***********************
+  map_snapshot_segment
+***********************/
+SNAP_SEGMENT map_snapshot_segment(char *fname)
+{
+   // Maps the snapshot segment fname into memory and sets up the typed views
+   // of each of its blocks. The blocks are found and checked by scan_blocks
+   // first, so this works with either SnapFormat.
+
+   int fd;
+   FILE *sfd;
+   struct stat st;
+   BLOCK_DIR dir;
+   SNAP_SEGMENT seg;
+
+   if(!(sfd = fopen(fname, "rb")))
+   {
+      printf("Error, could not open snapshot segment for mapping!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   scan_blocks(sfd, &dir);
+
+   fclose(sfd);
+
+   if((fd = open(fname, O_RDONLY)) < 0)
+   {
+      printf("Error, could not open snapshot segment for mapping!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(fstat(fd, &st) != 0)
+   {
+      printf("Error, could not stat snapshot segment!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   seg.length = st.st_size;
+
+   if((seg.map = mmap(NULL, seg.length, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+   {
+      printf("Error, could not map snapshot segment!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   // The mapping stays valid after the descriptor is closed
+   close(fd);
+
+   // Every block is touched exactly once, front to back
+   madvise(seg.map, seg.length, MADV_SEQUENTIAL);
+
+   seg.header = dir.header;
+   seg.id = (int *)map_block(&seg, &dir, IDS);
+   seg.density = (float *)map_block(&seg, &dir, RHO);
+
+   // The gas comes after the type 0 particles in the blocks that hold every
+   // type. The sph blocks only hold the gas
+   if(seg.id != NULL)
+   {
+      seg.id += seg.header.npart[0];
+   }
+
+   return seg;
+}
+
+
+
+/***********************
+       map_block
+***********************/
+char *map_block(SNAP_SEGMENT *seg, BLOCK_DIR *dir, enum fields blocknr)
+{
+   // Returns a pointer to the data of blocknr in the mapping, or NULL if the
+   // segment doesn't have that block
+
+   if(dir->offset[blocknr] < 0)
+   {
+      return NULL;
+   }
+
+   return seg->map + dir->offset[blocknr] + sizeof(int);
+}
+
+
 
-      // Open file if there's more than one per snapshot
-      if(header.num_files > 1)
+/***********************
+ unmap_snapshot_segment
+***********************/
+void unmap_snapshot_segment(SNAP_SEGMENT *seg)
+{
+   munmap(seg->map, seg->length);
+
+   seg->map = NULL;
+   seg->id = NULL;
+   seg->density = NULL;
+}
+
+
+
+/***********************
+    read_block_chunk
+***********************/
+void read_block_chunk(FILE *fd, long block_offset, size_t size, long start, int n, void *buf)
+{
+   // Reads n elements of size bytes from the block whose leading padding is at
+   // block_offset, starting with element start
+
+   if(fseek(fd, block_offset + sizeof(int) + start * size, SEEK_SET) != 0)
+   {
+      printf("Error, could not seek in snapshot segment!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   my_fread(buf, size, n, fd);
+}
+
+
+
+/***********************
+      scan_blocks
+***********************/
+void scan_blocks(FILE *fd, BLOCK_DIR *dir)
+{
+   // Walks the paddings of every block in the segment open in fd, without
+   // reading the blocks themselves, and records where the ones tspec uses
+   // are. Anything else (U, NE, NH, SFR, ...) is skipped. Also reads the
+   // segment's header into dir.
+   //
+   // SnapFormat 2 puts a small block in front of every block holding a four
+   // character label and the size of the next block plus its paddings, so the
+   // blocks are found by name. SnapFormat 1 has no labels, so the blocks are
+   // identified by their order: header, pos, vel, ids and then mass if any
+   // type needs it. If two gas blocks are left they're taken to be rho and hsml,
+   // like dspec writes. Otherwise they're assumed to be in Gadget's order of
+   // u, rho, (ne, nh with cooling), hsml, ...
+
+   int i;
+   int nblocks = 0;
+   int nextra;
+   int first;
+   int blksize1;
+   int blksize2;
+   int nextsize;
+   int field;
+   int *sizes = NULL;
+   int *fields = NULL;
+   long offset = 0;
+   long filesize;
+   long *offsets = NULL;
+   char label[4];
+
+   for(i = 0; i < NFIELDS; i++)
+   {
+      dir->offset[i] = -1;
+      dir->size[i] = 0;
+   }
+
+   fseek(fd, 0, SEEK_END);
+   filesize = ftell(fd);
+   rewind(fd);
+
+   // Format 2 starts with the 8 byte label block, format 1 with the 256 byte header
+   my_fread(&first, sizeof(int), 1, fd);
+
+   if(first == 8)
+   {
+      dir->format = 2;
+   }
+
+   else
+   {
+      dir->format = 1;
+   }
+
+   while(offset < filesize)
+   {
+      field = -1;
+
+      if(dir->format == 2)
       {
-         sprintf(filename, "%s.%d", snapfile, i);
+         fseek(fd, offset, SEEK_SET);
+         my_fread(&blksize1, sizeof(int), 1, fd);
+         my_fread(label, sizeof(char), 4, fd);
+         my_fread(&nextsize, sizeof(int), 1, fd);
+         my_fread(&blksize2, sizeof(int), 1, fd);
 
-         if(!(fd = fopen(filename, "rb")))
+         if((blksize1 != 8) || (blksize2 != 8))
          {
-            printf("Error, could not open snapshot segment for reading!\n");
+            printf("Error, bad block label in snapshot segment! Offset: %ld\n", offset);
             exit(EXIT_FAILURE);
          }
+
+         field = get_block_field(label);
+         offset += 4 * sizeof(int);
+      }
+
+      // Check the block's paddings
+      if(offset + (long)sizeof(int) > filesize)
+      {
+         printf("Error, snapshot segment is truncated! Offset: %ld\n", offset);
+         exit(EXIT_FAILURE);
       }
 
-      // Read the header
+      fseek(fd, offset, SEEK_SET);
       my_fread(&blksize1, sizeof(int), 1, fd);
-      my_fread(&theader, sizeof(IO_HEADER), 1, fd);
-      my_fread(&blksize2, sizeof(int), 1, fd);
 
-      blocknr = HEADER;
-      block_check(blocknr, blksize1, blksize2, theader);  
+      if((blksize1 < 0) || (offset + blksize1 + 2 * (long)sizeof(int) > filesize))
+      {
+         printf("Error, snapshot segment is truncated! Offset: %ld\n", offset);
+         exit(EXIT_FAILURE);
+      }
 
-      // Get the number of particles in the file
-      numpart = theader.npart[0] + theader.npart[1] + theader.npart[2] +
-                theader.npart[3] + theader.npart[4] + theader.npart[5];
+      fseek(fd, offset + sizeof(int) + blksize1, SEEK_SET);
+      my_fread(&blksize2, sizeof(int), 1, fd);
 
-      // Get the number of particles in the mass block
-      for(k = 0, n_with_masses = 0; k < 6; k++)
+      if(blksize1 != blksize2)
       {
-         if(theader.mass[k] == 0)
-         {
-            n_with_masses += theader.npart[k];
-         }
+         printf("Paddings don't match! Offset: %ld\n", offset);
+         exit(EXIT_FAILURE);
       }
 
-      // Allocate memory for particles
-      if(!(AP = calloc(numpart, sizeof(PARTICLE_DATA))))
+      if((dir->format == 2) && (nextsize != blksize1 + 2 * (int)sizeof(int)))
       {
-         printf("Error, could not allocate memory for particles!\n");
+         printf("Error, block label doesn't match block size! Offset: %ld\n", offset);
          exit(EXIT_FAILURE);
       }
 
-	   // Read positions and type
-	   my_fread(&blksize1, sizeof(int), 1, fd);
-
-	   for(k = 0, pc_new = pc; k < 6; k++)
-	   {
-		   for(n = 0; n < theader.npart[k]; n++)
-		   {
-			   my_fread(&AP[pc_new].pos[0], sizeof(float), 3, fd);
-			   AP[pc_new].type = k;								
-			   pc_new++;
-		   }
-	   }
-
-	   my_fread(&blksize2, sizeof(int), 1, fd);
-
-      blocknr = POS;
-      block_check(blocknr, blksize1, blksize2, theader);
-
-	   // Read velocities
-	   my_fread(&blksize1, sizeof(int), 1, fd);
-
-	   for(k = 0, pc_new = pc; k < 6; k++)
-	   {
-		   for(n = 0; n < theader.npart[k]; n++)
-		   {
-			   my_fread(&AP[pc_new].vel[0], sizeof(float), 3, fd);
-			   pc_new++;
-		   }
-	   }
-
-	   my_fread(&blksize2, sizeof(int), 1, fd);
-
-      blocknr = VEL;
-      block_check(blocknr, blksize1, blksize2, theader);
-
-	   // Read Ids
-	   my_fread(&blksize1, sizeof(int), 1, fd);
-
-	   for(k = 0, pc_new = pc; k < 6; k++)
-	   {
-		   for(n = 0; n < theader.npart[k]; n++)
-		   {
-			   my_fread(&AP[pc_new].id, sizeof(int), 1, fd);														
-			   pc_new++;
-		   }
-	   }
-
-	   my_fread(&blksize2, sizeof(int), 1, fd);
-
-      blocknr = IDS;
-      block_check(blocknr, blksize1, blksize2, theader);
-
-	   // Read masses
-	   if(n_with_masses > 0)
-	   {
-		   my_fread(&blksize1, sizeof(int), 1, fd);
-	   }
-
-	   for(k = 0, pc_new = pc; k < 6; k++)
-	   {
-		   for(n = 0; n < theader.npart[k]; n++)
-		   {
-			   AP[pc_new].type = k;
-			   if(theader.mass[k] == 0)
-			   {
-				   my_fread(&AP[pc_new].mass,sizeof(float), 1, fd);
-			   }
-			   else
-			   {
-				   AP[pc_new].mass = theader.mass[k];
-			   }
-			   pc_new++;
-		   }
-	   }
-
-	   if(n_with_masses > 0)
-	   {
-	      my_fread(&blksize2, sizeof(int), 1, fd);
-
-         blocknr = MASS;
-         block_check(blocknr, blksize1, blksize2, theader);
-	   }
-
-      // Gas only properties
-      if(theader.npart[1] > 0)
+      if(!(offsets = realloc(offsets, (nblocks + 1) * sizeof(long))) ||
+         !(sizes = realloc(sizes, (nblocks + 1) * sizeof(int))) ||
+         !(fields = realloc(fields, (nblocks + 1) * sizeof(int))))
       {
-         // Skip reading temp since dspec doesn't write it
+         printf("Error, could not allocate memory for block directory!\n");
+         exit(EXIT_FAILURE);
+      }
 
-		   // Read Density
-		   my_fread(&blksize1, sizeof(int), 1, fd);
+      offsets[nblocks] = offset;
+      sizes[nblocks] = blksize1;
+      fields[nblocks] = field;
+      nblocks++;
 
-		   for(n = 0, pc_sph = pc; n < theader.npart[1]; n++)
-		   {
-			   my_fread(&AP[pc_sph].density, sizeof(float), 1, fd);
-			   pc_sph++;
-		   }
+      offset += blksize1 + 2 * sizeof(int);
+   }
 
-		   my_fread(&blksize2, sizeof(int), 1, fd);
+   // The header is always first
+   if((nblocks == 0) || (sizes[0] != sizeof(IO_HEADER)))
+   {
+      printf("Error, snapshot segment doesn't start with a header!\n");
+      exit(EXIT_FAILURE);
+   }
 
-         blocknr = RHO;
-         block_check(blocknr, blksize1, blksize2, theader);
+   fseek(fd, offsets[0] + sizeof(int), SEEK_SET);
+   my_fread(&dir->header, sizeof(IO_HEADER), 1, fd);
 
-		   // Read Hsml
-		   my_fread(&blksize1, sizeof(int), 1, fd);
+   // Put the blocks in the directory
+   if(dir->format == 2)
+   {
+      // Only the first block with a given label counts
+      for(i = nblocks - 1; i >= 0; i--)
+      {
+         if(fields[i] >= 0)
+         {
+            dir->offset[fields[i]] = offsets[i];
+            dir->size[fields[i]] = sizes[i];
+         }
+      }
+   }
+
+   else
+   {
+      for(i = 0; (i <= IDS) && (i < nblocks); i++)
+      {
+         dir->offset[i] = offsets[i];
+         dir->size[i] = sizes[i];
+      }
+
+      if((get_block_size(MASS, dir->header) > 0) && (i < nblocks))
+      {
+         dir->offset[MASS] = offsets[i];
+         dir->size[MASS] = sizes[i];
+         i++;
+      }
+
+      nextra = nblocks - i;
+
+      if(nextra == 2)
+      {
+         field = 0;
+      }
 
-		   for(n = 0, pc_sph = pc; n < theader.npart[1]; n++)
-		   {
-			   my_fread(&AP[pc_sph].hsml, sizeof(float), 1, fd);
+      else
+      {
+         // Skip u
+         field = 1;
+      }
 
-            // Set the m_vir and in_halo flags
-            AP[pc_sph].m_vir = 0.0;
-            AP[pc_sph].in_halo = 0;
-			   pc_sph++;
-		   }
+      if(field < nextra)
+      {
+         dir->offset[RHO] = offsets[i + field];
+         dir->size[RHO] = sizes[i + field];
+      }
 
-		   my_fread(&blksize2, sizeof(int), 1, fd);
+      // Skip ne and nh if they're there
+      field++;
 
-         blocknr = HSML;
-         block_check(blocknr, blksize1, blksize2, theader);
+      if((nextra != 2) && dir->header.flag_cooling)
+      {
+         field += 2;
       }
 
-      // If there's more than one file per snapshot, we need to save the
-      // results before moving on
-      if(header.num_files > 1)
+      if(field < nextra)
       {
-         for(k = 0; k < theader.npart[1]; k++)
+         dir->offset[HSML] = offsets[i + field];
+         dir->size[HSML] = sizes[i + field];
+      }
+   }
+
+   // Make sure everything that's needed is there and is the right size
+   for(i = 0; i < NFIELDS; i++)
+   {
+      if(dir->offset[i] < 0)
+      {
+         if(get_block_size(i, dir->header) > 0)
          {
-            D[master].pos[0]  = AP[k].pos[0];
-            D[master].pos[1]  = AP[k].pos[1];
-            D[master].pos[2]  = AP[k].pos[2];
-            D[master].vel[0]  = AP[k].vel[0];
-            D[master].vel[1]  = AP[k].vel[1];
-            D[master].vel[2]  = AP[k].vel[2];
-            D[master].mass    = AP[k].mass;
-            D[master].density = AP[k].density;
-            D[master].hsml    = AP[k].hsml;
-            D[master].type    = AP[k].type;
-            D[master].id      = AP[k].id;
-
-            // Increment master index
-            master++;
+            printf("Error, snapshot segment is missing block %d!\n", i);
+            exit(EXIT_FAILURE);
          }
 
-         // Free AP
-         free(AP);
+         continue;
       }
 
-      // Close the file
-      fclose(fd);
+      block_check(i, dir->size[i], dir->size[i], dir->header);
    }
 
-   // Update ngas
-   *ngas = theader.npartTotal[1];
+   free(offsets);
+   free(sizes);
+   free(fields);
+}
+
+
+
+/***********************
+    get_block_field
+***********************/
+int get_block_field(char *label)
+{
+   // Gets which of the blocks in enum fields a SnapFormat 2 label is, or -1 if
+   // it's one that tspec doesn't use
 
-   if(theader.num_files == 1)
+   if(strncmp(label, "HEAD", 4) == 0)
    {
-      return AP;
+      return HEADER;
    }
 
-   else
+   if(strncmp(label, "POS ", 4) == 0)
+   {
+      return POS;
+   }
+
+   if(strncmp(label, "VEL ", 4) == 0)
+   {
+      return VEL;
+   }
+
+   if(strncmp(label, "ID  ", 4) == 0)
+   {
+      return IDS;
+   }
+
+   if(strncmp(label, "MASS", 4) == 0)
+   {
+      return MASS;
+   }
+
+   if(strncmp(label, "RHO ", 4) == 0)
+   {
+      return RHO;
+   }
+
+   if(strncmp(label, "HSML", 4) == 0)
    {
-      return D;
+      return HSML;
    }
+
+   return -1;
 }
 
 
@@ -441,15 +1245,3 @@ size_t my_fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
 
 
 
-/***********************
-        pid_cmp
-***********************/
-int pid_cmp(const void *p1, const void *p2)
-{
-   // Used with qsort to sort by id
-
-   const PARTICLE_DATA *elem1 = p1;
-   const PARTICLE_DATA *elem2 = p2;
-
-   return (int)(elem1->id - elem2->id);
-}
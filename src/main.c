@@ -25,15 +25,19 @@ Notes:   * Uses amiga halo files
 
 int main(int argc, char **argv)
 {
-   int i;
-   int ngas;
-   int n_this_task;
    double start;
    double end;
    double tot_time_local;
    double tot_time_global;
-   PARTICLE_DATA *P;
-   PARTICLE_DATA *All_P;
+
+   #ifdef STREAMING
+      int ntable;
+      int *table_pids;
+      float *table_mvir;
+   #else
+      PARTICLE_DATA *P;
+      PARTICLE_DATA *All_P = NULL;
+   #endif
 
    // Set up MPI
    MPI_Init(&argc, &argv);
@@ -64,16 +68,34 @@ int main(int argc, char **argv)
    {
       printf("Loading snapshot...\n");
       fflush(stdout);
-      header = load_header();
-      All_P = load_snapshot(&ngas);
-      
-      // Sort by id in ascending order. I'm not sure how to do this
-      // in parallel, which is why it's in serial
-      qsort(All_P, ngas, sizeof(PARTICLE_DATA), pid_cmp);
+      #ifdef HDF5_SNAPSHOT
+         header = load_header_hdf5();
+      #else
+         header = load_header();
+      #endif
+
+      #if !defined(PARALLEL_READ) && !defined(STREAMING)
+         #ifdef MMAP_SNAPSHOT
+            All_P = load_snapshot_mmap();
+         #else
+            All_P = load_snapshot();
+         #endif
+
+         // The loaders put each particle in slot id - 1 as they go, so
+         // All_P is already in ascending id order
+      #endif
    }
 
    // Bcast the header
    MPI_Bcast(&header, 1, mpi_header_type, 0, MPI_COMM_WORLD);  
+
+   // Every task reads its own segments and ends up with a contiguous range of ids,
+   // already in order. All_P then only refers to this task's particles
+   #ifdef HDF5_SNAPSHOT
+      All_P = load_snapshot_hdf5();
+   #elif defined(PARALLEL_READ)
+      All_P = load_snapshot_parallel();
+   #endif
    
    // Set cosmological parameters from header
    LITTLE_H = header.HubbleParam;
@@ -82,71 +104,95 @@ int main(int argc, char **argv)
    OMEGA_DE0 = header.OmegaLambda;
    OMEGA_K0 = 1.0 - header.Omega0 - header.OmegaLambda;
 
-   // Flag halo particles
-   if(thistask == 0)
-   {
-      printf("Flagging halo particles...\n");
-      fflush(stdout);
-   }
-   flag_halo_parts(All_P);
-
-   // Free halo resources
-   for(i = 0; i < nhalos_max; i++)
-   {   
-      // If there's only one AHF file set then H is only allocated on root     
-      if(n_halo_tasks == 1)
+   #ifdef STREAMING
+      // Only the header has been read. Instead of flagging P, each task gets the
+      // table of halo particles that it owns, and the snapshot is flagged against it
+      // as it streams past
+      if(thistask == 0)
       {
-         if(thistask == 0)
-         {
-            free(H[i].plist);
-            free(H[i].sublist);
-         }
+         printf("Building halo table...\n");
+         fflush(stdout);
       }
-
-      else
+      ntable = get_halo_table(&table_pids, &table_mvir);
+   #else
+      // Divide particles amongst the processors, so that each one flags the ones it
+      // owns. There's nothing to do if they were read in parallel. With ROOT_FLAGGING
+      // root flags them all first
+      #if defined(PARALLEL_READ) || defined(ROOT_FLAGGING)
+         P = All_P;
+      #else
+         P = split_particles(All_P);
+      #endif
+
+      // Flag halo particles
+      if(thistask == 0)
       {
-         free(H[i].plist);
-         free(H[i].sublist);
+         printf("Flagging halo particles...\n");
+         fflush(stdout);
       }
-   }
+      flag_halo_parts(P);
+   #endif
 
-   // If there's only one AHF file set then H is only allocated on root
-   if(n_halo_tasks == 1)
-   {
+   // Free halo resources
+   free_halos();
+
+   #ifdef STREAMING
+      #ifdef DEBUGGING
+         write_halo_table(table_pids, ntable);
+      #endif
+
+      // Read, flag, get temperatures and write a chunk at a time
       if(thistask == 0)
       {
-         free(H);
+         printf("Streaming snapshot...\n");
+         fflush(stdout);
       }
-   }
+      stream_snapshot(table_pids, table_mvir, ntable);
+
+      free(table_pids);
+      free(table_mvir);
+   #else
+      #ifdef DEBUGGING
+        #if defined(ROOT_FLAGGING) && !defined(PARALLEL_READ)
+           if(thistask == 0)
+           {
+              write_flagged_particles(P);
+           }
+        #else
+           write_flagged_particles(P);
+        #endif
+      #endif
+
+      // Divide the flagged particles amongst the processors
+      #if defined(ROOT_FLAGGING) && !defined(PARALLEL_READ)
+         P = split_particles(All_P);
+      #endif
+
+      // Calculate temperatures
+      if(thistask == 0)
+      {
+         printf("Calculating temperatures...\n");
+         fflush(stdout);
+      }
+      get_temperatures(P);
 
-   else
-   {
-      free(H);
-   }
+      #ifdef PROFILING
+         report_particle_memory(P);
+      #endif
 
-   #ifdef DEBUGGING
-     if(thistask == 0)
-     {
-        write_flagged_particles(All_P, ngas);
-     }
+      // Write data
+      if(thistask == 0)
+      {
+         printf("Writing data...\n");
+         fflush(stdout);
+      }
+      #ifdef HDF5_SNAPSHOT
+         write_particle_data_hdf5(P);
+      #else
+         write_particle_data(P);
+      #endif
    #endif
 
-   // Calculate temperatures
-   if(thistask == 0)
-   {
-      printf("Calculating temperatures...\n");
-      fflush(stdout);
-   }
-   P = get_temperatures(All_P, ngas, &n_this_task);
-
-   // Write data
-   if(thistask == 0)
-   {
-      printf("Writing data...\n");
-      fflush(stdout);
-   }
-   write_particle_data(P, n_this_task);
-
    // Get end time
    end = MPI_Wtime();
 
@@ -157,7 +203,7 @@ int main(int argc, char **argv)
 
    if(thistask == 0)
    {
-      printf("Total number of halos: %d\n", nhalos_max);
+      printf("Total number of halos: %d\n", nhalos_tot);
       printf("Total time to run: %lf\n", tot_time_global);
       printf("Done.\n");
    }
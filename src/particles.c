@@ -0,0 +1,407 @@
+/************************************************
+Title: particles.c
+Purpose: Contains functions for handling the
+         PARTICLE_DATA container: allocating,
+         copying, sending and sorting particles
+Notes:   * PARTICLE_DATA holds one array per field. Most
+           of these functions loop over the fields with
+           get_particle_fields, so they work on whatever
+           fields happen to be allocated
+         * The in_halo bitset isn't one of those fields.
+           It only exists after flagging, and the only
+           thing that moves particles after that is
+           split_particles, which sends it itself
+************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+    alloc_particles
+***********************/
+PARTICLE_DATA *alloc_particles(int n)
+{
+   // Allocates room for n particles with the fields that are read from the
+   // snapshot: id and density. Everything starts out zeroed, which
+   // place_particles relies on. The rest of the fields are NULL.
+
+   PARTICLE_DATA *P;
+
+   if(!(P = calloc(1, sizeof(PARTICLE_DATA))))
+   {
+      printf("Error, could not allocate memory for particles!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   P->n = n;
+   P->id = alloc_field(n, sizeof(int));
+   P->density = alloc_field(n, sizeof(float));
+
+   return P;
+}
+
+
+
+/***********************
+      alloc_field
+***********************/
+void *alloc_field(int n, size_t size)
+{
+   // Allocates a zeroed field of n particles with size bytes each. There's
+   // always room for at least one particle so that an empty field isn't NULL
+
+   void *field;
+
+   if(!(field = calloc(n + 1, size)))
+   {
+      printf("Error, could not allocate memory for particle field!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   return field;
+}
+
+
+
+/***********************
+     free_particles
+***********************/
+void free_particles(PARTICLE_DATA *P)
+{
+   int i;
+   PARTICLE_FIELD f[NPFIELDS];
+
+   if(P == NULL)
+   {
+      return;
+   }
+
+   get_particle_fields(P, f);
+
+   for(i = 0; i < NPFIELDS; i++)
+   {
+      free(*f[i].data);
+   }
+
+   free(P->in_halo);
+   free(P);
+}
+
+
+
+/***********************
+  get_particle_fields
+***********************/
+void get_particle_fields(PARTICLE_DATA *P, PARTICLE_FIELD *f)
+{
+   // Fills f with a description of each of P's fields, allocated or not
+
+   int i;
+
+   f[0].data = (void **)&P->id;
+   f[1].data = (void **)&P->density;
+   f[2].data = (void **)&P->temp;
+   f[3].data = (void **)&P->m_vir;
+
+   for(i = 0; i < NPFIELDS; i++)
+   {
+      f[i].ncomp = 1;
+      f[i].type = MPI_FLOAT;
+   }
+
+   f[0].type = MPI_INT;
+
+   // ints and floats are both four bytes
+   for(i = 0; i < NPFIELDS; i++)
+   {
+      f[i].size = f[i].ncomp * sizeof(float);
+   }
+}
+
+
+
+/***********************
+    resize_particles
+***********************/
+void resize_particles(PARTICLE_DATA *P, int n)
+{
+   // Changes the number of particles P has room for to n, keeping the first
+   // n (or P->n, if that's fewer) of them
+
+   int i;
+   PARTICLE_FIELD f[NPFIELDS];
+
+   get_particle_fields(P, f);
+
+   for(i = 0; i < NPFIELDS; i++)
+   {
+      if(*f[i].data == NULL)
+      {
+         continue;
+      }
+
+      if(!(*f[i].data = realloc(*f[i].data, (n + 1) * f[i].size)))
+      {
+         printf("Error, could not reallocate memory for particles!\n");
+         exit(EXIT_FAILURE);
+      }
+   }
+
+   P->n = n;
+}
+
+
+
+/***********************
+     copy_particle
+***********************/
+void copy_particle(PARTICLE_DATA *dst, int i, PARTICLE_DATA *src, int j)
+{
+   // Copies particle j of src to slot i of dst. Every field that src has is
+   // copied, so dst has to have at least those
+
+   int k;
+   PARTICLE_FIELD fd[NPFIELDS];
+   PARTICLE_FIELD fs[NPFIELDS];
+
+   get_particle_fields(dst, fd);
+   get_particle_fields(src, fs);
+
+   for(k = 0; k < NPFIELDS; k++)
+   {
+      if(*fs[k].data != NULL)
+      {
+         memcpy((char *)*fd[k].data + (size_t)i * fd[k].size,
+                (char *)*fs[k].data + (size_t)j * fs[k].size, fs[k].size);
+      }
+   }
+}
+
+
+
+/***********************
+   exchange_particles
+***********************/
+void exchange_particles(PARTICLE_DATA *send, int *sendcnts, int *sdispls, PARTICLE_DATA *recv,
+                        int *recvcnts, int *rdispls)
+{
+   // MPI_Alltoallv for particles. The counts and displacements are in
+   // particles. Every field that send has is sent, one MPI_Alltoallv per
+   // field, so recv has to have room for the same fields.
+
+   int i;
+   int k;
+   int *scnts;
+   int *sdisp;
+   int *rcnts;
+   int *rdisp;
+   PARTICLE_FIELD fs[NPFIELDS];
+   PARTICLE_FIELD fr[NPFIELDS];
+
+   if(!(scnts = calloc(ntasks, sizeof(int))) || !(sdisp = calloc(ntasks, sizeof(int))) ||
+      !(rcnts = calloc(ntasks, sizeof(int))) || !(rdisp = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for particle exchange counts!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   get_particle_fields(send, fs);
+   get_particle_fields(recv, fr);
+
+   for(k = 0; k < NPFIELDS; k++)
+   {
+      if(*fs[k].data == NULL)
+      {
+         continue;
+      }
+
+      for(i = 0; i < ntasks; i++)
+      {
+         scnts[i] = sendcnts[i] * fs[k].ncomp;
+         sdisp[i] = sdispls[i] * fs[k].ncomp;
+         rcnts[i] = recvcnts[i] * fs[k].ncomp;
+         rdisp[i] = rdispls[i] * fs[k].ncomp;
+      }
+
+      MPI_Alltoallv(*fs[k].data, scnts, sdisp, fs[k].type, *fr[k].data, rcnts, rdisp,
+                    fr[k].type, MPI_COMM_WORLD);
+   }
+
+   free(scnts);
+   free(sdisp);
+   free(rcnts);
+   free(rdisp);
+}
+
+
+
+/***********************
+  sort_particles_by_id
+***********************/
+void sort_particles_by_id(PARTICLE_DATA *P)
+{
+   // LSD radix sort on the ids, 16 bits at a time. Passes where every id has
+   // the same digit are skipped. Only the ids and their positions are sorted,
+   // and then each field is put in the new order in one pass
+
+   int i;
+   int k;
+   int pass;
+   int shift;
+   int n;
+   unsigned int digit;
+   unsigned int *keys;
+   unsigned int *key_buf;
+   int *order;
+   int *order_buf;
+   void *tmp;
+   char *sorted;
+   long *count;
+   PARTICLE_FIELD f[NPFIELDS];
+
+   n = P->n;
+
+   if(n < 2)
+   {
+      return;
+   }
+
+   keys = alloc_field(n, sizeof(unsigned int));
+   key_buf = alloc_field(n, sizeof(unsigned int));
+   order = alloc_field(n, sizeof(int));
+   order_buf = alloc_field(n, sizeof(int));
+
+   if(!(count = calloc(RADIX_BUCKETS + 1, sizeof(long))))
+   {
+      printf("Error, could not allocate memory for radix sort counts!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < n; i++)
+   {
+      keys[i] = (unsigned int)P->id[i];
+      order[i] = i;
+   }
+
+   for(pass = 0; pass < 2; pass++)
+   {
+      shift = 16 * pass;
+
+      memset(count, 0, (RADIX_BUCKETS + 1) * sizeof(long));
+
+      // Histogram the digits, offset by one so the prefix sum gives each
+      // bucket's starting position
+      for(i = 0; i < n; i++)
+      {
+         digit = (keys[i] >> shift) & (RADIX_BUCKETS - 1);
+         count[digit + 1]++;
+      }
+
+      digit = (keys[0] >> shift) & (RADIX_BUCKETS - 1);
+
+      if(count[digit + 1] == n)
+      {
+         continue;
+      }
+
+      for(i = 1; i <= RADIX_BUCKETS; i++)
+      {
+         count[i] += count[i - 1];
+      }
+
+      for(i = 0; i < n; i++)
+      {
+         digit = (keys[i] >> shift) & (RADIX_BUCKETS - 1);
+         key_buf[count[digit]] = keys[i];
+         order_buf[count[digit]] = order[i];
+         count[digit]++;
+      }
+
+      tmp = keys;
+      keys = key_buf;
+      key_buf = tmp;
+
+      tmp = order;
+      order = order_buf;
+      order_buf = tmp;
+   }
+
+   // Put every field in the new order
+   get_particle_fields(P, f);
+
+   for(k = 0; k < NPFIELDS; k++)
+   {
+      if(*f[k].data == NULL)
+      {
+         continue;
+      }
+
+      sorted = alloc_field(n, f[k].size);
+
+      for(i = 0; i < n; i++)
+      {
+         memcpy(sorted + (size_t)i * f[k].size, (char *)*f[k].data + (size_t)order[i] * f[k].size,
+                f[k].size);
+      }
+
+      free(*f[k].data);
+      *f[k].data = sorted;
+   }
+
+   free(count);
+   free(keys);
+   free(key_buf);
+   free(order);
+   free(order_buf);
+}
+
+
+
+/***********************
+ report_particle_memory
+***********************/
+void report_particle_memory(PARTICLE_DATA *P)
+{
+   // Root prints how many bytes per particle the fields currently in memory
+   // take, summed over every task, next to what the same particles took when
+   // pos, vel and hsml were kept in memory too and the flag was an int. Nearly
+   // all of the difference is pos, vel and hsml (see passthrough.c)
+
+   int i;
+   PARTICLE_FIELD f[NPFIELDS];
+   double bytes[2] = {0.0, 0.0};
+   double full;
+
+   get_particle_fields(P, f);
+
+   for(i = 0; i < NPFIELDS; i++)
+   {
+      if(*f[i].data != NULL)
+      {
+         bytes[0] += (double)P->n * f[i].size;
+      }
+   }
+
+   if(P->in_halo != NULL)
+   {
+      bytes[0] += BITSET_BYTES(P->n);
+   }
+
+   bytes[1] = P->n;
+
+   MPI_Allreduce(MPI_IN_PLACE, bytes, 2, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+
+   // id, pos, vel, density, hsml, temp, m_vir and in_halo
+   full = 2 * sizeof(int) + 10 * sizeof(float);
+
+   if((thistask == 0) && (bytes[1] > 0))
+   {
+      printf("Particle data takes %.3f bytes per particle (%.0f with pos, vel and hsml in "
+             "memory)\n", bytes[0] / bytes[1], full);
+   }
+}
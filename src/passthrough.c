@@ -0,0 +1,435 @@
+/************************************************
+Title: passthrough.c
+Purpose: Contains functions for copying the fields
+         that tspec doesn't use (pos, vel and hsml)
+         from the snapshot to the output
+Notes:   * These fields aren't kept in PARTICLE_DATA. When
+           the output is written they're read again, one
+           field and PASSTHROUGH_CHUNK particles at a time,
+           and sent to the task holding each particle's id
+         * Works whether or not the ids are dense, since
+           the particles are found by id in P
+************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <mpi.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+ load_passthrough_field
+***********************/
+float *load_passthrough_field(PARTICLE_DATA *P, enum fields blocknr, BLOCK_DIR *dirs)
+{
+   // Returns blocknr for each of the particles in P, in the same order as P.
+   // The gas in every segment is cut into chunks and the chunks are handed
+   // out to the tasks round-robin, the same as in stream_snapshot. Each task
+   // reads the ids and blocknr for its chunk and sends every value to the
+   // task whose part of P has that id. This is collective, so every task does
+   // the same number of rounds, even if it's out of chunks. dirs has every
+   // segment's blocks (see get_segment_dirs), and isn't used with HDF5.
+
+   int i;
+   int k;
+   int ncomp;
+   int round;
+   int nrounds;
+   int nchunks = 0;
+   int chunk;
+   int seg;
+   int n;
+   int nrecv;
+   int slot;
+   int dense;
+   int last;
+   int open_seg = -1;
+   long start;
+   int *seg_npart;
+   int *last_ids;
+   int *ids;
+   int *owner;
+   int *id_sbuf;
+   int *id_rbuf;
+   int *found;
+   int *sendcnts;
+   int *recvcnts;
+   int *sdispls;
+   int *rdispls;
+   int *offset;
+   float *vals;
+   float *val_sbuf;
+   float *val_rbuf;
+   float *field;
+   FILE *fd = NULL;
+
+   #ifdef PROFILING
+      double t_start;
+      double t_end;
+
+      t_start = MPI_Wtime();
+   #endif
+
+   ncomp = get_passthrough_ncomp(blocknr);
+
+   // Get the number of gas particles in each segment
+   #ifdef HDF5_SNAPSHOT
+      seg_npart = get_segment_npart_hdf5();
+   #else
+      if(!(seg_npart = calloc(header.num_files, sizeof(int))))
+      {
+         printf("Error, could not allocate memory for seg_npart!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      for(i = 0; i < header.num_files; i++)
+      {
+         seg_npart[i] = dirs[i].header.npart[1];
+      }
+   #endif
+
+   for(i = 0; i < header.num_files; i++)
+   {
+      nchunks += (seg_npart[i] + PASSTHROUGH_CHUNK - 1) / PASSTHROUGH_CHUNK;
+   }
+
+   nrounds = (nchunks + ntasks - 1) / ntasks;
+
+   // Every task holds a run of ids in ascending order, and the runs are in
+   // task order, so the last id on each task says where every id goes. Tasks
+   // without particles get the last id of the task before them
+   if(!(last_ids = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for last_ids!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   last = (P->n > 0) ? P->id[P->n - 1] : INT_MIN;
+
+   MPI_Allgather(&last, 1, MPI_INT, last_ids, 1, MPI_INT, MPI_COMM_WORLD);
+
+   for(i = 1; i < ntasks; i++)
+   {
+      if(last_ids[i] < last_ids[i - 1])
+      {
+         last_ids[i] = last_ids[i - 1];
+      }
+   }
+
+   // With dense ids a particle's slot is just its offset from the first id
+   dense = (P->n > 0) && (P->id[P->n - 1] - P->id[0] == P->n - 1);
+
+   field = alloc_field(P->n, ncomp * sizeof(float));
+
+   if(!(sendcnts = calloc(ntasks, sizeof(int))) || !(recvcnts = calloc(ntasks, sizeof(int))) ||
+      !(sdispls = calloc(ntasks, sizeof(int))) || !(rdispls = calloc(ntasks, sizeof(int))) ||
+      !(offset = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for passthrough counts!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(!(ids = malloc(PASSTHROUGH_CHUNK * sizeof(int))) ||
+      !(owner = malloc(PASSTHROUGH_CHUNK * sizeof(int))) ||
+      !(id_sbuf = malloc(PASSTHROUGH_CHUNK * sizeof(int))) ||
+      !(vals = malloc(ncomp * PASSTHROUGH_CHUNK * sizeof(float))) ||
+      !(val_sbuf = malloc(ncomp * PASSTHROUGH_CHUNK * sizeof(float))))
+   {
+      printf("Error, could not allocate memory for passthrough chunk!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(round = 0; round < nrounds; round++)
+   {
+      chunk = round * ntasks + thistask;
+      n = 0;
+
+      if(chunk < nchunks)
+      {
+         // Find the segment the chunk is in and where it starts
+         for(seg = 0; chunk >= (seg_npart[seg] + PASSTHROUGH_CHUNK - 1) / PASSTHROUGH_CHUNK;
+             seg++)
+         {
+            chunk -= (seg_npart[seg] + PASSTHROUGH_CHUNK - 1) / PASSTHROUGH_CHUNK;
+         }
+
+         start = (long)chunk * PASSTHROUGH_CHUNK;
+         n = seg_npart[seg] - start;
+
+         if(n > PASSTHROUGH_CHUNK)
+         {
+            n = PASSTHROUGH_CHUNK;
+         }
+
+         read_passthrough_chunk(seg, dirs, &fd, &open_seg, blocknr, ncomp, start, n, ids,
+                                vals);
+      }
+
+      // Bucket the chunk by owner
+      memset(sendcnts, 0, ntasks * sizeof(int));
+
+      for(i = 0; i < n; i++)
+      {
+         owner[i] = get_passthrough_owner(ids[i], last_ids);
+         sendcnts[owner[i]]++;
+      }
+
+      for(i = 1; i < ntasks; i++)
+      {
+         sdispls[i] = sdispls[i - 1] + sendcnts[i - 1];
+      }
+
+      memcpy(offset, sdispls, ntasks * sizeof(int));
+
+      for(i = 0; i < n; i++)
+      {
+         id_sbuf[offset[owner[i]]] = ids[i];
+         memcpy(&val_sbuf[ncomp * offset[owner[i]]], &vals[ncomp * i], ncomp * sizeof(float));
+         offset[owner[i]]++;
+      }
+
+      MPI_Alltoall(sendcnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
+
+      for(i = 1; i < ntasks; i++)
+      {
+         rdispls[i] = rdispls[i - 1] + recvcnts[i - 1];
+      }
+
+      nrecv = rdispls[ntasks - 1] + recvcnts[ntasks - 1];
+
+      if(!(id_rbuf = malloc((nrecv + 1) * sizeof(int))) ||
+         !(val_rbuf = malloc((ncomp * nrecv + 1) * sizeof(float))))
+      {
+         printf("Error, could not allocate memory for passthrough recv buffers!\n");
+         exit(EXIT_FAILURE);
+      }
+
+      MPI_Alltoallv(id_sbuf, sendcnts, sdispls, MPI_INT, id_rbuf, recvcnts, rdispls, MPI_INT,
+                    MPI_COMM_WORLD);
+
+      // The values have ncomp floats per particle
+      for(i = 0; i < ntasks; i++)
+      {
+         sendcnts[i] *= ncomp;
+         sdispls[i] *= ncomp;
+         recvcnts[i] *= ncomp;
+         rdispls[i] *= ncomp;
+      }
+
+      MPI_Alltoallv(val_sbuf, sendcnts, sdispls, MPI_FLOAT, val_rbuf, recvcnts, rdispls,
+                    MPI_FLOAT, MPI_COMM_WORLD);
+
+      // Put everything we got in its place
+      for(k = 0; k < nrecv; k++)
+      {
+         if(dense)
+         {
+            slot = id_rbuf[k] - P->id[0];
+         }
+
+         else
+         {
+            found = bsearch(&id_rbuf[k], P->id, P->n, sizeof(int), cmpfunc);
+            slot = (found != NULL) ? found - P->id : -1;
+         }
+
+         if((slot < 0) || (slot >= P->n))
+         {
+            printf("Error, task %d was sent particle %d, which it doesn't have!\n", thistask,
+                   id_rbuf[k]);
+            exit(EXIT_FAILURE);
+         }
+
+         memcpy(&field[ncomp * slot], &val_rbuf[ncomp * k], ncomp * sizeof(float));
+      }
+
+      free(id_rbuf);
+      free(val_rbuf);
+   }
+
+   if(fd != NULL)
+   {
+      fclose(fd);
+   }
+
+   #ifdef PROFILING
+      t_end = MPI_Wtime();
+      MPI_Allreduce(MPI_IN_PLACE, &t_end, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+      if(thistask == 0)
+      {
+         printf("Copied block %d from the snapshot in %d rounds in %e secs\n", blocknr,
+                nrounds, t_end - t_start);
+      }
+   #endif
+
+   free(seg_npart);
+   free(last_ids);
+   free(sendcnts);
+   free(recvcnts);
+   free(sdispls);
+   free(rdispls);
+   free(offset);
+   free(ids);
+   free(owner);
+   free(id_sbuf);
+   free(vals);
+   free(val_sbuf);
+
+   return field;
+}
+
+
+
+/***********************
+ read_passthrough_chunk
+***********************/
+void read_passthrough_chunk(int seg, BLOCK_DIR *dirs, FILE **fd, int *open_seg,
+                            enum fields blocknr, int ncomp, long start, int n, int *ids,
+                            float *vals)
+{
+   // Reads the ids and blocknr for gas particles start to start + n of
+   // snapshot segment seg. *fd is the segment in *open_seg, and is only
+   // opened again when seg is a different one. Chunks are handed out in
+   // order, so that's once per segment
+
+   #ifdef HDF5_SNAPSHOT
+      read_hdf5_segment_chunk(seg, get_hdf5_dataset_name(IDS), H5T_NATIVE_INT, 1, start, n,
+                              ids);
+      read_hdf5_segment_chunk(seg, get_hdf5_dataset_name(blocknr), H5T_NATIVE_FLOAT, ncomp,
+                              start, n, vals);
+   #else
+      long first;
+      char filename[256];
+
+      if(seg != *open_seg)
+      {
+         if(*fd != NULL)
+         {
+            fclose(*fd);
+         }
+
+         get_snapshot_fname(seg, filename, sizeof(filename));
+
+         if(!(*fd = fopen(filename, "rb")))
+         {
+            printf("Error, task %d could not open snapshot segment %d for reading!\n",
+                   thistask, seg);
+            exit(EXIT_FAILURE);
+         }
+
+         *open_seg = seg;
+      }
+
+      // Like read_snapshot_segment, the gas comes after the type 0 particles in
+      // the blocks that hold every type
+      first = dirs[seg].header.npart[0];
+
+      read_block_chunk(*fd, dirs[seg].offset[IDS], sizeof(int), first + start, n, ids);
+
+      if((blocknr == RHO) || (blocknr == HSML))
+      {
+         first = 0;
+      }
+
+      read_block_chunk(*fd, dirs[seg].offset[blocknr], ncomp * sizeof(float), first + start, n,
+                       vals);
+   #endif
+}
+
+
+
+/***********************
+    get_segment_dirs
+***********************/
+BLOCK_DIR *get_segment_dirs(void)
+{
+   // Root scans the blocks of every snapshot segment once and sends everyone
+   // the lot, so the passthrough fields can all be read without scanning the
+   // segments again
+
+   int i;
+   char filename[256];
+   FILE *fd;
+   BLOCK_DIR *dirs;
+
+   if(!(dirs = calloc(header.num_files, sizeof(BLOCK_DIR))))
+   {
+      printf("Error, could not allocate memory for segment block directories!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(thistask == 0)
+   {
+      for(i = 0; i < header.num_files; i++)
+      {
+         get_snapshot_fname(i, filename, sizeof(filename));
+
+         if(!(fd = fopen(filename, "rb")))
+         {
+            printf("Error, could not open snapshot segment %d for reading!\n", i);
+            exit(EXIT_FAILURE);
+         }
+
+         scan_blocks(fd, &dirs[i]);
+
+         fclose(fd);
+      }
+   }
+
+   MPI_Bcast(dirs, header.num_files * sizeof(BLOCK_DIR), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+   return dirs;
+}
+
+
+
+/***********************
+  get_passthrough_owner
+***********************/
+int get_passthrough_owner(int id, int *last_ids)
+{
+   // Returns the first task whose last id is at least id (see
+   // load_passthrough_field)
+
+   int lo = 0;
+   int hi = ntasks - 1;
+   int mid;
+
+   while(lo < hi)
+   {
+      mid = (lo + hi) / 2;
+
+      if(last_ids[mid] < id)
+      {
+         lo = mid + 1;
+      }
+
+      else
+      {
+         hi = mid;
+      }
+   }
+
+   return lo;
+}
+
+
+
+/***********************
+  get_passthrough_ncomp
+***********************/
+int get_passthrough_ncomp(enum fields blocknr)
+{
+   // Number of floats per particle in blocknr
+
+   if((blocknr == POS) || (blocknr == VEL))
+   {
+      return 3;
+   }
+
+   return 1;
+}
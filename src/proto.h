@@ -7,6 +7,10 @@ Notes: Organized by where function is defined
    #include "allvars.h"
 #endif
 
+#ifdef HDF5_SNAPSHOT
+   #include <hdf5.h>
+#endif
+
 
 
 /***********************
@@ -20,7 +24,12 @@ void get_a_dot(void);
 /***********************
        debugging
 ***********************/
-void write_flagged_particles(PARTICLE_DATA *, int);
+void write_flagged_particles(PARTICLE_DATA *);
+void write_halo_table(int *, int);
+void benchmark_ahf_parser(void);
+void benchmark_halo_index(int);
+void benchmark_plist_sort(void);
+void benchmark_remove_duplicates(void);
 
 
 
@@ -28,13 +37,58 @@ void write_flagged_particles(PARTICLE_DATA *, int);
          flag.c
 ***********************/
 void flag_halo_parts(PARTICLE_DATA *);
+void flag_halo_parts_distributed(PARTICLE_DATA *);
+int get_halo_table(int **, float **);
+int halo_pair_cmp(const void *, const void *);
+int route_halo_pids(int **, long int **, float **);
 void flag_halo_parts_mult_file_sets(PARTICLE_DATA *);
+void get_halo_depths(void);
+long int get_flag_key(int);
+int *init_flag_depths(PARTICLE_DATA *);
+int claim_particle(int *, int, int);
 void flag_halo_parts_single_file_set(PARTICLE_DATA *);
 void flag(PARTICLE_DATA *);
-void remove_duplicates(int);
+void remove_duplicates(void);
+void remove_replied_duplicates(long int *, int, int *);
+void remove_plist_overlap(int, int *, int);
+void remove_duplicates_local(void);
 long int *get_mia_subs(int, int *);
-void remove_duplicates_single_set_optimized(int);
 void remove_duplicates_single_set(int);
+void remove_duplicates_single_set_brute(int);
+
+
+
+/***********************
+      halo_cache.c
+***********************/
+int load_halo_cache(void);
+void write_halo_cache(void);
+void get_halo_cache_sources(HALO_CACHE_HEADER *);
+long get_halo_cache_length(HALO_CACHE_HEADER *);
+char *get_halo_cache_fname(void);
+
+
+
+/***********************
+      halo_sets.c
+***********************/
+void assign_halo_sets(int);
+int halo_set_cmp(const void *, const void *);
+int reads_halo_set(int);
+void select_halo_set(int);
+void set_halo_order(long int);
+int halo_order_cmp(const void *, const void *);
+void read_halo_sets(void);
+void read_halo_set_part(MPI_Comm);
+
+
+
+/***********************
+      halo_split.c
+***********************/
+int read_halo_particles_split(void);
+int read_halo_particles_part(MPI_Comm);
+long gather_on_root(void *, long, MPI_Datatype, size_t, void **);
 
 
 
@@ -42,14 +96,54 @@ void remove_duplicates_single_set(int);
         halos.c
 ***********************/
 void load_halos(void);
+void read_halo_set(void);
 void read_halo_particles(void);
-void read_halo_substruct(void);
-void read_virial_mass(void);
+void free_halos(void);
+void *grow_halo_list(void *, long int *, long int, size_t);
+void build_halo_index(HALO_INDEX *, HALO_DATA *, int);
+int find_halo(HALO_INDEX *, long int);
+unsigned long hash_hid(long int);
+void free_halo_index(HALO_INDEX *);
+void read_halo_substruct(int);
+void read_virial_mass(long int);
+void open_ahf_reader(AHF_READER *, FILE *);
+void fill_ahf_reader(AHF_READER *);
+int skip_ahf_space(AHF_READER *);
+char *next_ahf_token(AHF_READER *);
+long int read_ahf_long(AHF_READER *);
+float read_ahf_float(AHF_READER *);
+void skip_ahf_line(AHF_READER *);
+void close_ahf_reader(AHF_READER *);
 int cmpfunc(const void *, const void *);
+void sort_plist(int *, long int);
+void find_halo_fnames(void);
 char *get_halo_fname(char *);
 
 
 
+/***********************
+       hdf5_io.c
+***********************/
+#ifdef HDF5_SNAPSHOT
+   IO_HEADER load_header_hdf5(void);
+   void read_hdf5_header(hid_t, IO_HEADER *);
+   void read_hdf5_attribute(hid_t, char *, hid_t, void *);
+   void get_hdf5_filename(int, char *, size_t);
+   PARTICLE_DATA *load_snapshot_hdf5(void);
+   int *get_segment_npart_hdf5(void);
+   void read_hdf5_segment_chunk(int, char *, hid_t, int, long, int, void *);
+   char *get_hdf5_dataset_name(enum fields);
+   void read_hdf5_slab(hid_t, char *, hid_t, int, long, int, void *);
+   void write_particle_data_hdf5(PARTICLE_DATA *);
+   void write_hdf5_in_turns(char *, char *, hid_t, int, long, int, void *);
+   void write_hdf5_header(hid_t);
+   void write_hdf5_attribute(hid_t, char *, hid_t, int, void *);
+   void create_hdf5_dataset(hid_t, char *, hid_t, int, long);
+   void write_hdf5_slab(hid_t, char *, hid_t, int, long, int, void *);
+#endif
+
+
+
 /***********************
          init
 ***********************/
@@ -62,25 +156,81 @@ void make_custom_mpi_type(void);
         load.c
 ***********************/
 IO_HEADER load_header(void);
-PARTICLE_DATA *load_snapshot(int *);
+void get_snapshot_fname(int, char *, size_t);
+PARTICLE_DATA *load_snapshot(void);
+PARTICLE_DATA *read_snapshot_segment(FILE *, IO_HEADER *, double *);
+PARTICLE_DATA *load_snapshot_parallel(void);
+int *assign_snapshot_segments(void);
+PARTICLE_DATA *redistribute_particles(PARTICLE_DATA *);
+void get_slab(int, int, int *, int *);
+int pid_owner(int, int);
+void read_block_chunk(FILE *, long, size_t, long, int, void *);
+void scan_blocks(FILE *, BLOCK_DIR *);
+int get_block_field(char *);
 void block_check(enum fields, int, int, IO_HEADER);
 int get_block_size(enum fields, IO_HEADER);
 size_t my_fread(void *, size_t, size_t, FILE *);
-int pid_cmp(const void *, const void *);
+PARTICLE_DATA *load_snapshot_mmap(void);
+SNAP_SEGMENT map_snapshot_segment(char *);
+char *map_block(SNAP_SEGMENT *, BLOCK_DIR *, enum fields);
+void unmap_snapshot_segment(SNAP_SEGMENT *);
+void place_particles(PARTICLE_DATA *, int *, int *, PARTICLE_DATA *);
+void sort_placed_particles(PARTICLE_DATA *);
+
+
+
+/***********************
+      particles.c
+***********************/
+PARTICLE_DATA *alloc_particles(int);
+void *alloc_field(int, size_t);
+void free_particles(PARTICLE_DATA *);
+void get_particle_fields(PARTICLE_DATA *, PARTICLE_FIELD *);
+void resize_particles(PARTICLE_DATA *, int);
+void copy_particle(PARTICLE_DATA *, int, PARTICLE_DATA *, int);
+void exchange_particles(PARTICLE_DATA *, int *, int *, PARTICLE_DATA *, int *, int *);
+void sort_particles_by_id(PARTICLE_DATA *);
+void report_particle_memory(PARTICLE_DATA *);
+
+
+
+/***********************
+     passthrough.c
+***********************/
+float *load_passthrough_field(PARTICLE_DATA *, enum fields, BLOCK_DIR *);
+void read_passthrough_chunk(int, BLOCK_DIR *, FILE **, int *, enum fields, int, long, int,
+                            int *, float *);
+BLOCK_DIR *get_segment_dirs(void);
+int get_passthrough_owner(int, int *);
+int get_passthrough_ncomp(enum fields);
+
+
+
+/***********************
+        stream.c
+***********************/
+void stream_snapshot(int *, float *, int);
+int *get_segment_npart(void);
+void lookup_halo_mvir(int *, int, float *, int *, float *, int);
 
 
 
 /***********************
      temperature.c
 ***********************/
-PARTICLE_DATA *get_temperatures(PARTICLE_DATA *, int, int *);
+void get_temperatures(PARTICLE_DATA *);
+void get_temp_params(float *, float *);
+float particle_temp(int, float, float, float, float);
 float get_T0(void);
-PARTICLE_DATA *split_particles(PARTICLE_DATA *, int, int *);
+PARTICLE_DATA *split_particles(PARTICLE_DATA *);
 
 
 
 /***********************
         write.c
 ***********************/
-void write_particle_data(PARTICLE_DATA *, int);
+void write_particle_data(PARTICLE_DATA *);
+void write_output_header(MPI_File, long *);
+void write_output_block(MPI_File, long, int, MPI_Datatype, long, int, void *);
+void get_output_offsets(long *);
 size_t my_fwrite(void *, size_t, size_t, FILE *);
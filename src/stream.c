@@ -0,0 +1,405 @@
+/************************************************
+Title: stream.c
+Purpose: Contains functions for streaming the
+         snapshot through tspec a chunk at a time
+         instead of loading it all at once
+Notes:   * Only used with STREAMING. Each task only ever
+           holds STREAM_CHUNK particles plus its share of
+           the halo table (see get_halo_table), so the
+           snapshot can be bigger than a node's memory
+         * The output is in the same order as the snapshot
+           (segment by segment) instead of sorted by id
+************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <mpi.h>
+#include "allvars.h"
+#include "proto.h"
+
+
+
+/***********************
+    stream_snapshot
+***********************/
+void stream_snapshot(int *table_pids, float *table_mvir, int ntable)
+{
+   // Driver function for streaming. The gas in every segment is cut into chunks of
+   // at most STREAM_CHUNK particles and the chunks are handed out to the tasks
+   // round-robin. Each task reads a chunk, flags it against the halo table, gets
+   // the temperatures and writes the chunk straight to its place in the output.
+   // The halo table lookup and the writes are collective, so every task does the
+   // same number of rounds, even if it's out of chunks.
+
+   int i;
+   int round;
+   int nrounds;
+   int nchunks = 0;
+   int chunk;
+   int seg;
+   int open_seg = -1;
+   int n;
+   long start;
+   long first;
+   long out_index;
+   int *seg_npart;
+   long *seg_first;
+   long out_offset[7];
+   float T0;
+   float rho_b;
+   float *pos;
+   float *vel;
+   float *density;
+   float *hsml;
+   float *temp;
+   float *mvir;
+   int *ids;
+   char filename[256];
+   char tspec_file[256];
+   FILE *fd = NULL;
+   BLOCK_DIR dir;
+   MPI_File fh;
+
+   #ifdef PROFILING
+      double t_start;
+      double t_end;
+
+      t_start = MPI_Wtime();
+   #endif
+
+   // Get the number of gas particles in each segment
+   seg_npart = get_segment_npart();
+
+   // Where each segment's particles start in the output
+   if(!(seg_first = calloc(header.num_files, sizeof(long))))
+   {
+      printf("Error, could not allocate memory for seg_first!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < header.num_files; i++)
+   {
+      if(i > 0)
+      {
+         seg_first[i] = seg_first[i - 1] + seg_npart[i - 1];
+      }
+
+      nchunks += (seg_npart[i] + STREAM_CHUNK - 1) / STREAM_CHUNK;
+   }
+
+   nrounds = (nchunks + ntasks - 1) / ntasks;
+
+   // Set up the output file. It's written with MPI-IO, the same as
+   // write_particle_data, so the tasks' writes don't go through separate
+   // stdio buffers
+   get_output_offsets(out_offset);
+
+   if(snprintf(tspec_file, sizeof(tspec_file), "%s-tspec", snapfile) >= (int)sizeof(tspec_file))
+   {
+      printf("Error, the output file name is too long!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(MPI_File_open(MPI_COMM_WORLD, tspec_file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+   {
+      printf("Error, task %d could not open output file for writing!\n", thistask);
+      exit(EXIT_FAILURE);
+   }
+
+   // Cut off anything left over from an older, bigger file
+   MPI_File_set_size(fh, out_offset[6]);
+
+   if(thistask == 0)
+   {
+      write_output_header(fh, out_offset);
+   }
+
+   // Get what we need for the temperatures
+   get_temp_params(&T0, &rho_b);
+
+   // Allocate the chunk
+   if(!(pos = malloc(3 * STREAM_CHUNK * sizeof(float))) ||
+      !(vel = malloc(3 * STREAM_CHUNK * sizeof(float))) ||
+      !(density = malloc(STREAM_CHUNK * sizeof(float))) ||
+      !(hsml = malloc(STREAM_CHUNK * sizeof(float))) ||
+      !(temp = malloc(STREAM_CHUNK * sizeof(float))) ||
+      !(mvir = malloc(STREAM_CHUNK * sizeof(float))) ||
+      !(ids = malloc(STREAM_CHUNK * sizeof(int))))
+   {
+      printf("Error, could not allocate memory for stream chunk!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(round = 0; round < nrounds; round++)
+   {
+      chunk = round * ntasks + thistask;
+      n = 0;
+      out_index = 0;
+
+      if(chunk < nchunks)
+      {
+         // Find the segment the chunk is in and where it starts
+         for(seg = 0; chunk >= (seg_npart[seg] + STREAM_CHUNK - 1) / STREAM_CHUNK; seg++)
+         {
+            chunk -= (seg_npart[seg] + STREAM_CHUNK - 1) / STREAM_CHUNK;
+         }
+
+         start = (long)chunk * STREAM_CHUNK;
+         n = seg_npart[seg] - start;
+
+         if(n > STREAM_CHUNK)
+         {
+            n = STREAM_CHUNK;
+         }
+
+         out_index = seg_first[seg] + start;
+
+         // Chunks are handed out in order, so we only move forward through the segments
+         if(seg != open_seg)
+         {
+            if(fd != NULL)
+            {
+               fclose(fd);
+            }
+
+            get_snapshot_fname(seg, filename, sizeof(filename));
+
+            if(!(fd = fopen(filename, "rb")))
+            {
+               printf("Error, task %d could not open snapshot segment %d for reading!\n",
+                      thistask, seg);
+               exit(EXIT_FAILURE);
+            }
+
+            scan_blocks(fd, &dir);
+            open_seg = seg;
+         }
+
+         // Read the chunk. Like read_snapshot_segment, the gas comes after the type 0
+         // particles in the blocks that hold every type
+         first = dir.header.npart[0];
+
+         read_block_chunk(fd, dir.offset[POS], 3 * sizeof(float), first + start, n, pos);
+         read_block_chunk(fd, dir.offset[VEL], 3 * sizeof(float), first + start, n, vel);
+         read_block_chunk(fd, dir.offset[IDS], sizeof(int), first + start, n, ids);
+         read_block_chunk(fd, dir.offset[RHO], sizeof(float), start, n, density);
+         read_block_chunk(fd, dir.offset[HSML], sizeof(float), start, n, hsml);
+      }
+
+      // Flag. Every task has to take part in this, chunk or no chunk
+      lookup_halo_mvir(ids, n, mvir, table_pids, table_mvir, ntable);
+
+      // Get the temperatures. Particles that aren't in a halo come back with an m_vir
+      // of -1
+      for(i = 0; i < n; i++)
+      {
+         temp[i] = particle_temp(mvir[i] >= 0.0, mvir[i], density[i], T0, rho_b);
+      }
+
+      // Write the chunk out. The writes are collective too, so tasks without a chunk
+      // write nothing
+      write_output_block(fh, out_offset[0], 3, MPI_FLOAT, out_index, n, pos);
+      write_output_block(fh, out_offset[1], 3, MPI_FLOAT, out_index, n, vel);
+      write_output_block(fh, out_offset[2], 1, MPI_INT, out_index, n, ids);
+      write_output_block(fh, out_offset[3], 1, MPI_FLOAT, out_index, n, temp);
+      write_output_block(fh, out_offset[4], 1, MPI_FLOAT, out_index, n, density);
+      write_output_block(fh, out_offset[5], 1, MPI_FLOAT, out_index, n, hsml);
+   }
+
+   if(fd != NULL)
+   {
+      fclose(fd);
+   }
+
+   MPI_File_close(&fh);
+
+   #ifdef PROFILING
+      t_end = MPI_Wtime();
+
+      if(thistask == 0)
+      {
+         printf("Streamed %d chunks of up to %d particles in %d rounds in %e secs\n",
+                nchunks, STREAM_CHUNK, nrounds, t_end - t_start);
+      }
+   #endif
+
+   free(pos);
+   free(vel);
+   free(density);
+   free(hsml);
+   free(temp);
+   free(mvir);
+   free(ids);
+   free(seg_npart);
+   free(seg_first);
+}
+
+
+
+/***********************
+   get_segment_npart
+***********************/
+int *get_segment_npart(void)
+{
+   // Root reads the header of every segment and sends everyone the number of gas
+   // particles in each
+
+   int i;
+   int *seg_npart;
+   char filename[256];
+   FILE *fd;
+   BLOCK_DIR dir;
+
+   if(!(seg_npart = calloc(header.num_files, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for seg_npart!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   if(thistask == 0)
+   {
+      for(i = 0; i < header.num_files; i++)
+      {
+         get_snapshot_fname(i, filename, sizeof(filename));
+
+         if(!(fd = fopen(filename, "rb")))
+         {
+            printf("Error, could not open snapshot segment %d for reading!\n", i);
+            exit(EXIT_FAILURE);
+         }
+
+         scan_blocks(fd, &dir);
+         seg_npart[i] = dir.header.npart[1];
+
+         fclose(fd);
+      }
+   }
+
+   MPI_Bcast(seg_npart, header.num_files, MPI_INT, 0, MPI_COMM_WORLD);
+
+   return seg_npart;
+}
+
+
+
+/***********************
+    lookup_halo_mvir
+***********************/
+void lookup_halo_mvir(int *ids, int n, float *mvir, int *table_pids, float *table_mvir,
+                      int ntable)
+{
+   // Gets m_vir for each of the n particles in ids from the task whose halo table
+   // holds it (see get_halo_table). Particles that aren't in a halo get -1. This is
+   // collective: the ids go out to their owners with one MPI_Alltoallv and the
+   // masses come back with another.
+
+   int i;
+   int ngas;
+   int dest;
+   int nrecv;
+   int *sendcnts;
+   int *recvcnts;
+   int *sdispls;
+   int *rdispls;
+   int *offset;
+   int *slot;
+   int *id_sbuf;
+   int *id_rbuf;
+   int *found;
+   float *mvir_sbuf;
+   float *mvir_rbuf;
+
+   ngas = header.npartTotal[1];
+
+   if(!(sendcnts = calloc(ntasks, sizeof(int))) || !(recvcnts = calloc(ntasks, sizeof(int))) ||
+      !(sdispls = calloc(ntasks, sizeof(int))) || !(rdispls = calloc(ntasks, sizeof(int))) ||
+      !(offset = calloc(ntasks, sizeof(int))))
+   {
+      printf("Error, could not allocate memory for lookup counts!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < n; i++)
+   {
+      sendcnts[pid_owner(ids[i], ngas)]++;
+   }
+
+   for(i = 1; i < ntasks; i++)
+   {
+      sdispls[i] = sdispls[i - 1] + sendcnts[i - 1];
+   }
+
+   memcpy(offset, sdispls, ntasks * sizeof(int));
+
+   // slot remembers where each id came from so the answers can be put back
+   if(!(id_sbuf = malloc((n + 1) * sizeof(int))) || !(slot = malloc((n + 1) * sizeof(int))) ||
+      !(mvir_rbuf = malloc((n + 1) * sizeof(float))))
+   {
+      printf("Error, could not allocate memory for lookup send buffers!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   for(i = 0; i < n; i++)
+   {
+      dest = pid_owner(ids[i], ngas);
+      slot[offset[dest]] = i;
+      id_sbuf[offset[dest]] = ids[i];
+      offset[dest]++;
+   }
+
+   MPI_Alltoall(sendcnts, 1, MPI_INT, recvcnts, 1, MPI_INT, MPI_COMM_WORLD);
+
+   for(i = 1; i < ntasks; i++)
+   {
+      rdispls[i] = rdispls[i - 1] + recvcnts[i - 1];
+   }
+
+   nrecv = rdispls[ntasks - 1] + recvcnts[ntasks - 1];
+
+   if(!(id_rbuf = malloc((nrecv + 1) * sizeof(int))) ||
+      !(mvir_sbuf = malloc((nrecv + 1) * sizeof(float))))
+   {
+      printf("Error, could not allocate memory for lookup recv buffers!\n");
+      exit(EXIT_FAILURE);
+   }
+
+   MPI_Alltoallv(id_sbuf, sendcnts, sdispls, MPI_INT, id_rbuf, recvcnts, rdispls, MPI_INT,
+                 MPI_COMM_WORLD);
+
+   // Look up what we were sent
+   for(i = 0; i < nrecv; i++)
+   {
+      found = bsearch(&id_rbuf[i], table_pids, ntable, sizeof(int), cmpfunc);
+
+      if(found != NULL)
+      {
+         mvir_sbuf[i] = table_mvir[found - table_pids];
+      }
+
+      else
+      {
+         mvir_sbuf[i] = -1.0;
+      }
+   }
+
+   // Send the answers back the way they came
+   MPI_Alltoallv(mvir_sbuf, recvcnts, rdispls, MPI_FLOAT, mvir_rbuf, sendcnts, sdispls,
+                 MPI_FLOAT, MPI_COMM_WORLD);
+
+   for(i = 0; i < n; i++)
+   {
+      mvir[slot[i]] = mvir_rbuf[i];
+   }
+
+   free(sendcnts);
+   free(recvcnts);
+   free(sdispls);
+   free(rdispls);
+   free(offset);
+   free(slot);
+   free(id_sbuf);
+   free(id_rbuf);
+   free(mvir_sbuf);
+   free(mvir_rbuf);
+}
@@ -6,6 +6,7 @@ Notes: Based on Bertone's code
 ************************************************/
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <gsl/gsl_errno.h>
 #include <gsl/gsl_spline.h>
@@ -17,20 +18,42 @@ Notes: Based on Bertone's code
 /***********************
    get_temperatures
 ***********************/
-PARTICLE_DATA *get_temperatures(PARTICLE_DATA *All_P, int ngas, int *n_this_task)
+void get_temperatures(PARTICLE_DATA *P)
 {
-   // Does as the name says
+   // Does as the name says for the particles in P
 
    int i;
+   int in_halo;
+   float m_vir;
    float T0;
+   float rho_b;
+
+   get_temp_params(&T0, &rho_b);
+
+   P->temp = alloc_field(P->n, sizeof(float));
+
+   for(i = 0; i < P->n; i++)
+   {
+      in_halo = IN_HALO(P->in_halo, i);
+      m_vir = in_halo ? P->m_vir[i] : 0.0;
+
+      P->temp[i] = particle_temp(in_halo, m_vir, P->density[i], T0, rho_b);
+   }
+}
+
+
+
+/***********************
+    get_temp_params
+***********************/
+void get_temp_params(float *T0, float *rho_b)
+{
+   // Gets the quantities every particle's temperature depends on: T0 and the mean
+   // baryon density (cgs). Sets a_dot too. Has to be called by every task.
+
    float rho_c;
    float rho_mean;
-   float rho_b;
-   float r_vir;
-   float v_vir;
-   float rho_phys;
    float G = 6.67e-8;
-   PARTICLE_DATA *P;
 
    // Get a_dot
    get_a_dot();
@@ -38,10 +61,10 @@ PARTICLE_DATA *get_temperatures(PARTICLE_DATA *All_P, int ngas, int *n_this_task
    // Get T0
    if(thistask == 0)
    {
-      T0 = get_T0();
+      *T0 = get_T0();
    }
 
-   MPI_Bcast(&T0, 1, MPI_FLOAT, 0, MPI_COMM_WORLD);
+   MPI_Bcast(T0, 1, MPI_FLOAT, 0, MPI_COMM_WORLD);
 
    // Get the critical density of the Universe (cgs units)
    rho_c = 3.0 * pow(a_dot / header.time, 2.0) / (8.0 * M_PI * G);
@@ -52,38 +75,44 @@ PARTICLE_DATA *get_temperatures(PARTICLE_DATA *All_P, int ngas, int *n_this_task
               pow(a_dot / header.time, 2.0)) * rho_c;
 
    // Get the average baryon density by multiplying by baryon_frac
-   rho_b = BARYON_FRAC * rho_mean;
+   *rho_b = BARYON_FRAC * rho_mean;
+}
 
-   // Divide particles amongst the processors
-   P = split_particles(All_P, ngas, n_this_task);
 
-   for(i = 0; i < *n_this_task; i++)
-   {
-      // Check to see if particle is in halo
-      if(P[i].in_halo == 1)
-      {
-         // Get r_vir (Bertone thesis eq 2.10) G is in cgs, so put cm^3 to km^3 and 
-         // g to M_sun. This puts r_vir in km. See notes 3/11/16
-         r_vir = pow((1.989e18 * G * P[i].m_vir) / (100.0 * LITTLE_H * (a_dot * a_dot 
-                 / (header.time * header.time))), 1.0 / 3.0);
 
-         // Get V_vir (Bertone thesis eq 2.11) in km/s (1.989e18 is the conversion)
-         v_vir = sqrt(1.989e18 * G * P[i].m_vir / (r_vir * LITTLE_H));
+/***********************
+     particle_temp
+***********************/
+float particle_temp(int in_halo, float m_vir, float density, float T0, float rho_b)
+{
+   // Gets the temperature of a single particle. T0 and rho_b come from
+   // get_temp_params
 
-         // Get the temp (Bertone thesis eq 2.12) (Kelvin) (1e10 is the conversion)
-         P[i].temp = 1e10 * MOL_WEIGHT * PROTON_MASS * v_vir * v_vir / (2.0 * BOLTZMANN);
-      }
+   float r_vir;
+   float v_vir;
+   float rho_phys;
+   float G = 6.67e-8;
 
-      // Not in halo
-      else
-      {
-         // Bertone thesis eq. 1.4 (Kelvin. Need factor for putting P.dens -> g/cm^3)
-         rho_phys = P[i].density / (header.time * header.time * header.time);
-         P[i].temp = T0 * pow(rho_phys * BARYON_FRAC * LITTLE_H * LITTLE_H * GUM_IN_G / (rho_b * pow(GUL_IN_CM, 3.0)), 1.0 / 1.7);
-      }
+   // Check to see if particle is in halo
+   if(in_halo == 1)
+   {
+      // Get r_vir (Bertone thesis eq 2.10) G is in cgs, so put cm^3 to km^3 and 
+      // g to M_sun. This puts r_vir in km. See notes 3/11/16
+      r_vir = pow((1.989e18 * G * m_vir) / (100.0 * LITTLE_H * (a_dot * a_dot 
+              / (header.time * header.time))), 1.0 / 3.0);
+
+      // Get V_vir (Bertone thesis eq 2.11) in km/s (1.989e18 is the conversion)
+      v_vir = sqrt(1.989e18 * G * m_vir / (r_vir * LITTLE_H));
+
+      // Get the temp (Bertone thesis eq 2.12) (Kelvin) (1e10 is the conversion)
+      return 1e10 * MOL_WEIGHT * PROTON_MASS * v_vir * v_vir / (2.0 * BOLTZMANN);
    }
 
-   return P;
+   // Not in halo
+   // Bertone thesis eq. 1.4 (Kelvin. Need factor for putting P.dens -> g/cm^3)
+   rho_phys = density / (header.time * header.time * header.time);
+
+   return T0 * pow(rho_phys * BARYON_FRAC * LITTLE_H * LITTLE_H * GUM_IN_G / (rho_b * pow(GUL_IN_CM, 3.0)), 1.0 / 1.7);
 }
 
 
@@ -99,6 +128,7 @@ float get_T0(void)
    FILE *fd;
    int i;
    int nlines = 0;
+   int max_lines = 256;
    double dummy;
    float T;
    double *z;
@@ -113,46 +143,47 @@ float get_T0(void)
       exit(EXIT_FAILURE);
    }
 
-   // Get the number of lines in the file
-   while((i = getc(fd)) != EOF)
-   {
-      if(i == '\n')
-      {
-         nlines++;
-      }
-   }
-
-   // Get rid of heading line
-   nlines = nlines - 1;
-
-   // Go back to beginning of file
-   rewind(fd);
-
    // Skip heading line
    while((i = getc(fd)) != '\n')
    {
       continue;
    }
 
-   // Allocate memory for z and T0 arrays
-   if(!(z = calloc(nlines, sizeof(double))))
+   // Allocate memory for z and T0 arrays. They're grown as the file is read,
+   // so that it's only read once
+   if(!(z = calloc(max_lines, sizeof(double))))
    {
       printf("Error, could not allocate memory for z array in get_T0!\n");
       exit(EXIT_FAILURE);
    }
    
-   if(!(temp = calloc(nlines, sizeof(double))))
+   if(!(temp = calloc(max_lines, sizeof(double))))
    {
       printf("Error, could not allocate memory for T0 array in get_T0!\n");
       exit(EXIT_FAILURE);
    }
 
    // Read z and T0. Order of data is: z nHI/nH nHeI/nH nHeII/nH T0(K)
-   for(i = 0; i < nlines; i++)
+   while(fscanf(fd, "%lf %lf %lf %lf %lf\n", &z[nlines], &dummy, &dummy, &dummy,
+                &temp[nlines]) == 5)
    {
-      fscanf(fd, "%lf %lf %lf %lf %lf\n", &z[i], &dummy, &dummy, &dummy, &temp[i]);
+      nlines++;
+
+      if(nlines == max_lines)
+      {
+         max_lines *= 2;
+
+         if(!(z = realloc(z, max_lines * sizeof(double))) ||
+            !(temp = realloc(temp, max_lines * sizeof(double))))
+         {
+            printf("Error, could not allocate memory for Bolton's table in get_T0!\n");
+            exit(EXIT_FAILURE);
+         }
+      }
    }
 
+   fclose(fd);
+
    // The gsl requires the x values (redshifts, in this case) to be in strictly
    // increasing order, but the temp file goes from past (high z) to present (low
    // z). So I'm going to convert them to scale factors (which increase from past
@@ -170,6 +201,8 @@ float get_T0(void)
 
    gsl_spline_free(spline);
    gsl_interp_accel_free(accl);
+   free(z);
+   free(temp);
 
    return T;
 }
@@ -179,50 +212,64 @@ float get_T0(void)
 /***********************
     split_particles
 ***********************/
-PARTICLE_DATA *split_particles(PARTICLE_DATA *All_P, int ngas, int *n_this_task)
+PARTICLE_DATA *split_particles(PARTICLE_DATA *All_P)
 {
+   // Scatters All_P from root so that every task ends up with its own slab of
+   // ids (see get_slab). Each field is sent with its own MPI_Scatterv. The
+   // flags come too if All_P has been flagged already (see ROOT_FLAGGING)
+
    int i;
+   int k;
+   int ngas;
+   int flagged = 0;
    int n_to_send;
-   int nleft;
-   int *p_displs;
-   int *p_sendcnts;
+   int first_id;
+   int *p_displs = NULL;
+   int *p_sendcnts = NULL;
+   int *f_displs = NULL;
+   int *f_sendcnts = NULL;
+   unsigned char *bits = NULL;
    PARTICLE_DATA *p_rbuf;
-   
-   // Broadcast ngas
-   MPI_Bcast(&ngas, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-   // Get number of particles per processor
-   n_to_send = floor((float)ngas / (float)ntasks);
-
-   // Figure out how many particles are left
-   nleft = ngas - (ntasks * n_to_send);
+   PARTICLE_FIELD fs[NPFIELDS];
+   PARTICLE_FIELD fr[NPFIELDS];
 
-   // Append these particles to the last processor
-   if(thistask == (ntasks - 1))
+   // Broadcast ngas
+   if(thistask == 0)
    {
-      n_to_send += nleft;
+      ngas = All_P->n;
+      flagged = (All_P->in_halo != NULL);
    }
 
+   MPI_Bcast(&ngas, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Bcast(&flagged, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   // Get number of particles per processor. The last processor also gets the
+   // particles that are left over
+   get_slab(thistask, ngas, &first_id, &n_to_send);
+
    // Create the displs, rbuf, and sendcounts
    if(thistask == 0)
    {
-      if(!(p_displs = calloc(ntasks, sizeof(int))))
+      if(!(p_displs = calloc(ntasks, sizeof(int))) || !(f_displs = calloc(ntasks, sizeof(int))))
       {
          printf("Error, could not allocate memory for p_displs!\n");
          exit(EXIT_FAILURE);
       }
 
-      if(!(p_sendcnts = calloc(ntasks, sizeof(int))))
+      if(!(p_sendcnts = calloc(ntasks, sizeof(int))) ||
+         !(f_sendcnts = calloc(ntasks, sizeof(int))))
       {
          printf("Error, could not allocate memory for p_sendcnts!\n");
          exit(EXIT_FAILURE);
       }
    }
 
-   if(!(p_rbuf = calloc(n_to_send, sizeof(PARTICLE_DATA))))
+   p_rbuf = alloc_particles(n_to_send);
+
+   if(flagged)
    {
-      printf("Error, could not allocate memory for p_rbuf!\n");
-      exit(EXIT_FAILURE); 
+      p_rbuf->m_vir = alloc_field(n_to_send, sizeof(float));
+      p_rbuf->in_halo = alloc_field(BITSET_BYTES(n_to_send), 1);
    }
 
    // Now tell root how many particles to send to each processor
@@ -237,26 +284,78 @@ PARTICLE_DATA *split_particles(PARTICLE_DATA *All_P, int ngas, int *n_this_task)
       {
          p_displs[i] = p_displs[i - 1] + p_sendcnts[i - 1];
       }
+
+      get_particle_fields(All_P, fs);
    }
 
-   // Send the particles to the other processors
-   MPI_Scatterv(All_P, p_sendcnts, p_displs, mpi_particle_type, p_rbuf, n_to_send, 
-                mpi_particle_type, 0, MPI_COMM_WORLD);
+   get_particle_fields(p_rbuf, fr);
+
+   // Send the particles to the other processors, one field at a time
+   for(k = 0; k < NPFIELDS; k++)
+   {
+      if(*fr[k].data == NULL)
+      {
+         continue;
+      }
+
+      if(thistask == 0)
+      {
+         for(i = 0; i < ntasks; i++)
+         {
+            f_sendcnts[i] = p_sendcnts[i] * fr[k].ncomp;
+            f_displs[i] = p_displs[i] * fr[k].ncomp;
+         }
+      }
+
+      MPI_Scatterv(thistask == 0 ? *fs[k].data : NULL, f_sendcnts, f_displs, fr[k].type,
+                   *fr[k].data, n_to_send * fr[k].ncomp, fr[k].type, 0, MPI_COMM_WORLD);
+   }
+
+   // The flags, if there are any
+   if(flagged)
+   {
+      // A task's bits don't have to start on a byte, so root copies each task's
+      // bits into a bitset of their own before sending them
+      if(thistask == 0)
+      {
+         for(i = 0; i < ntasks; i++)
+         {
+            f_sendcnts[i] = BITSET_BYTES(p_sendcnts[i]);
+            f_displs[i] = (i > 0) ? f_displs[i - 1] + f_sendcnts[i - 1] : 0;
+         }
+
+         bits = alloc_field(f_displs[ntasks - 1] + f_sendcnts[ntasks - 1], 1);
+
+         for(i = 0; i < ntasks; i++)
+         {
+            for(k = 0; k < p_sendcnts[i]; k++)
+            {
+               if(IN_HALO(All_P->in_halo, p_displs[i] + k))
+               {
+                  SET_IN_HALO(bits + f_displs[i], k);
+               }
+            }
+         }
+      }
+
+      MPI_Scatterv(bits, f_sendcnts, f_displs, MPI_UNSIGNED_CHAR, p_rbuf->in_halo,
+                   BITSET_BYTES(n_to_send), MPI_UNSIGNED_CHAR, 0, MPI_COMM_WORLD);
+   }
 
    // Free memory
    if(thistask == 0)
    {
       free(p_displs);
       free(p_sendcnts);
+      free(f_displs);
+      free(f_sendcnts);
+      free(bits);
    }
 
-   // Update n_this_task
-   *n_this_task = n_to_send;
-
    // We no longer need All_P on root, and so we free it
    if(thistask == 0)
    {
-      free(All_P);
+      free_particles(All_P);
    }
 
    return p_rbuf;
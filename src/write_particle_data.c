@@ -16,175 +16,204 @@ Notes:   This function was ripped from the original dspec
 /***********************
          write
 ***********************/
-void write_particle_data(PARTICLE_DATA *P, int n_this_task)
+void write_particle_data(PARTICLE_DATA *P)
 {
    // Does as the name says, really. With the data.
+   //
+   // I want a single output file, because it means no changes have to be made
+   // to my other codes, but there's no need to gather everything onto root for
+   // that. The tasks hold consecutive runs of ids, in order (see split_particles
+   // and redistribute_particles), so every task knows where its particles go in
+   // each block and writes them there itself with a collective MPI-IO write.
+   // Root only writes the header and the paddings.
 
-   FILE *fd;
-   char tspec_file[256];
-   int blksize;
    int k;
-   int n_with_mass = 0; // This is very bad. I should recalc this, but
-                        // I know it's zero cos they're dm particles.
-   PARTICLE_DATA *SP;
-   int *rcnts;
-   int *displs;
-
-   // First regather all the particles onto root, as I just want a single
-   // output file, and this is the easiest way to get that. I want a single
-   // output file because it means no changes have to be made to my other 
-   // codes.
-
-   // Allocate memory for recvcounts, displs, and SP
+   int n_before = 0;
+   char tspec_file[256];
+   long out_offset[7];
+   long file_size;
+   enum fields passthrough[3] = {POS, VEL, HSML};
+   int passthrough_block[3] = {0, 1, 5};
+   float *buf;
+   BLOCK_DIR *dirs;
+   MPI_File fh;
+
+   #ifdef PROFILING
+      double start;
+      double end;
+
+      start = MPI_Wtime();
+   #endif
+
+   // Where this task's particles start in each block
+   MPI_Exscan(&P->n, &n_before, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+
    if(thistask == 0)
    {
-      if(!(rcnts = calloc(ntasks, sizeof(int))))
-      {
-         printf("Error, count not allocate memory for rcnts when gathering to root!\n");
-         exit(EXIT_FAILURE);
-      }
+      n_before = 0;
+   }
 
-      if(!(displs = calloc(ntasks, sizeof(int))))
-      {
-         printf("Error, count not allocate memory for displs when gathering to root!\n");
-         exit(EXIT_FAILURE);
-      }
+   get_output_offsets(out_offset);
+   file_size = out_offset[6];
 
-      if(!(SP = calloc(header.npartTotal[1], sizeof(PARTICLE_DATA))))
-      {
-         printf("Error, could not allocate memory for SP when gathering to root!\n");
-         exit(EXIT_FAILURE);
-      }
+   // Open file for writing
+   if(snprintf(tspec_file, sizeof(tspec_file), "%s-tspec", snapfile) >= (int)sizeof(tspec_file))
+   {
+      printf("Error, the output file name is too long!\n");
+      exit(EXIT_FAILURE);
    }
 
-   // Get n_this_task from each processor
-   MPI_Gather(&n_this_task, 1, MPI_INT, rcnts, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
-   // Set up displs
-   if(thistask == 0)
+   if(MPI_File_open(MPI_COMM_WORLD, tspec_file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
    {
-      displs[0] = 0;
-      for(k = 1; k < ntasks; k++)
-      {
-         displs[k] = displs[k - 1] + rcnts[k - 1];
-      }
+      printf("Error, could not open file for writing dm data!\n");
+      exit(EXIT_FAILURE);
    }
 
-   MPI_Gatherv(P, n_this_task, mpi_particle_type, SP, rcnts, displs, mpi_particle_type, 0, 
-               MPI_COMM_WORLD);
+   // Cut off anything left over from an older, bigger file
+   MPI_File_set_size(fh, file_size);
 
-   // Free
    if(thistask == 0)
    {
-      free(displs);
-      free(rcnts);
+      write_output_header(fh, out_offset);
    }
 
-   free(P);
+   // What tspec keeps in memory is written straight from P
+   write_output_block(fh, out_offset[2], 1, MPI_INT, n_before, P->n, P->id);
+   write_output_block(fh, out_offset[3], 1, MPI_FLOAT, n_before, P->n, P->temp);
+   write_output_block(fh, out_offset[4], 1, MPI_FLOAT, n_before, P->n, P->density);
 
-   // Now continue on with writing the file on root
-   if(thistask == 0)
+   // pos, vel and hsml are copied from the snapshot one field at a time. The
+   // segments' blocks are only found once for all three
+   dirs = get_segment_dirs();
+
+   for(k = 0; k < 3; k++)
    {
-      // Open file for writing
-      sprintf(tspec_file, "%s-tspec", snapfile);
+      buf = load_passthrough_field(P, passthrough[k], dirs);
+      write_output_block(fh, out_offset[passthrough_block[k]],
+                         get_passthrough_ncomp(passthrough[k]), MPI_FLOAT, n_before, P->n, buf);
+      free(buf);
+   }
+
+   free(dirs);
+
+   // Close the file
+   MPI_File_close(&fh);
 
-      if(!(fd = fopen(tspec_file, "wb")))
+   #ifdef PROFILING
+      end = MPI_Wtime();
+      MPI_Allreduce(MPI_IN_PLACE, &end, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+
+      if(thistask == 0)
       {
-         printf("Error, could not open file for writing dm data!\n");
-         exit(EXIT_FAILURE);
+         printf("Wrote %e MB of particle data in %e secs (%e MB/s)\n", file_size / 1048576.0,
+                end - start, file_size / 1048576.0 / (end - start));
       }
+   #endif
 
-      // Write the header
-      blksize = 256;
+   // Free
+   free_particles(P);
+}
 
-      // Because I changed this code to read all the data at once and am
-      // now writing it all to just one file, I need to change header.npart
-      // to be the same as header.npartTotal. Only need to do for dm, since 
-      // all others should be 0
-      header.npart[1] = header.npartTotal[1];
 
-      // Also have to have num_files for the same reason
-      header.num_files = 1;
 
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      my_fwrite(&header, sizeof(IO_HEADER), 1, fd);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
+/***********************
+  write_output_header
+***********************/
+void write_output_header(MPI_File fh, long *out_offset)
+{
+   // Writes the header and the padding around every block, which are where
+   // get_output_offsets put them in out_offset. Only root calls this, and the
+   // tasks fill the blocks in themselves (see write_output_block).
+   //
+   // Because I changed this code to read all the data at once and am
+   // now writing it all to just one file, I need to change npart to be
+   // the same as npartTotal. Only need to do for dm, since all others
+   // should be 0. Also have to have num_files for the same reason
 
-      // Positions
-      blksize = header.npartTotal[1] * 3 * sizeof(float);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      for(k = 0; k < header.npartTotal[1]; k++)
-      {
-         my_fwrite(&SP[k].pos[0], sizeof(float), 3, fd);
-      }
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-   
-      // Velocities
-      blksize = header.npartTotal[1] * 3 * sizeof(float);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      for(k = 0; k < header.npartTotal[1]; k++)
-      {
-         my_fwrite(&SP[k].vel[0], sizeof(float), 3, fd);
-      }
-      my_fwrite(&blksize, sizeof(int), 1, fd);
+   int k;
+   int blksize;
+   int ok = 1;
+   IO_HEADER h;
+
+   h = header;
+   h.npart[1] = header.npartTotal[1];
+   h.num_files = 1;
+
+   blksize = sizeof(IO_HEADER);
+   ok &= (MPI_File_write_at(fh, 0, &blksize, 1, MPI_INT, MPI_STATUS_IGNORE) == MPI_SUCCESS);
+   ok &= (MPI_File_write_at(fh, sizeof(int), &h, sizeof(IO_HEADER), MPI_BYTE,
+                            MPI_STATUS_IGNORE) == MPI_SUCCESS);
+   ok &= (MPI_File_write_at(fh, sizeof(int) + sizeof(IO_HEADER), &blksize, 1, MPI_INT,
+                            MPI_STATUS_IGNORE) == MPI_SUCCESS);
+
+   // There's no mass block, since the masses are all in the header
+   for(k = 0; k < 6; k++)
+   {
+      // Each block runs up to the next one's leading padding
+      blksize = out_offset[k + 1] - out_offset[k] - 2 * sizeof(int);
 
-      // IDs
-      blksize = header.npartTotal[1] * sizeof(int);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      for(k = 0; k < header.npartTotal[1]; k++)
-      {
-         my_fwrite(&SP[k].id, sizeof(int), 1, fd);
-      }
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-   
-      // Masses
-      blksize = n_with_mass * sizeof(float);
+      ok &= (MPI_File_write_at(fh, out_offset[k], &blksize, 1, MPI_INT,
+                               MPI_STATUS_IGNORE) == MPI_SUCCESS);
+      ok &= (MPI_File_write_at(fh, out_offset[k] + sizeof(int) + blksize, &blksize, 1, MPI_INT,
+                               MPI_STATUS_IGNORE) == MPI_SUCCESS);
+   }
 
-      if(n_with_mass > 0)
-      {
-         my_fwrite(&blksize, sizeof(int), 1, fd);
+   if(!ok)
+   {
+      printf("Error, could not write the output header!\n");
+      exit(EXIT_FAILURE);
+   }
+}
 
-         for(k = 0; k < header.npartTotal[1]; k++)
-         {
-            my_fwrite(&SP[k].mass, sizeof(float), 1, fd);
-         }
 
-         my_fwrite(&blksize, sizeof(int), 1, fd);
-      }
 
-      // Sph properties
-      // Temp
-      blksize = header.npartTotal[1] * sizeof(float);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      for(k = 0; k < header.npartTotal[1]; k++)
-      {
-         my_fwrite(&SP[k].temp, sizeof(float), 1, fd);
-      }
-      my_fwrite(&blksize, sizeof(int), 1, fd);
+/***********************
+   write_output_block
+***********************/
+void write_output_block(MPI_File fh, long block_offset, int ncomp, MPI_Datatype type,
+                        long start, int n, void *buf)
+{
+   // Collectively writes n particles with ncomp values of type each to the
+   // output block whose leading padding is at block_offset, starting at
+   // particle start. Every task has to call this, even if n is 0
 
-      // Density
-      blksize = header.npartTotal[1] * sizeof(float);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      for(k = 0; k < header.npartTotal[1]; k++)
-      {
-         my_fwrite(&SP[k].density, sizeof(float), 1, fd);
-      }
-      my_fwrite(&blksize, sizeof(int), 1, fd);
+   int tsize;
 
-      // Hsml
-      blksize = header.npartTotal[1] * sizeof(float);
-      my_fwrite(&blksize, sizeof(int), 1, fd);
-      for(k = 0; k < header.npartTotal[1]; k++)
-      {
-         my_fwrite(&SP[k].hsml, sizeof(float), 1, fd);
-      }
-      my_fwrite(&blksize, sizeof(int), 1, fd);
+   MPI_Type_size(type, &tsize);
+
+   if(MPI_File_write_at_all(fh, block_offset + sizeof(int) + start * ncomp * tsize, buf,
+                            n * ncomp, type, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+   {
+      printf("Error, task %d could not write to output file!\n", thistask);
+      exit(EXIT_FAILURE);
+   }
+}
 
-      // Close the file
-      fclose(fd);
 
-      // Free
-      free(SP);
+
+/***********************
+   get_output_offsets
+***********************/
+void get_output_offsets(long *out_offset)
+{
+   // Gets where the leading padding of each block is in the output file, and
+   // in out_offset[6] where the file ends, so out_offset needs room for 7. The
+   // blocks are pos, vel, ids, temp, density and hsml, with no mass block
+
+   int i;
+   long ngas;
+   long elsize[6] = {3 * sizeof(float), 3 * sizeof(float), sizeof(int), sizeof(float),
+                     sizeof(float), sizeof(float)};
+
+   ngas = header.npartTotal[1];
+
+   // The header
+   out_offset[0] = sizeof(IO_HEADER) + 2 * sizeof(int);
+
+   for(i = 1; i <= 6; i++)
+   {
+      out_offset[i] = out_offset[i - 1] + ngas * elsize[i - 1] + 2 * sizeof(int);
    }
 }
 